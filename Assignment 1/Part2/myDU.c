@@ -1,90 +1,917 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
 #include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <linux/stat.h>
+#include <linux/io_uring.h>
 
-unsigned long calculate_dir_size(const char *path, int write_pipe);
+/*
+ * Usage: myDU [-j threads] [-u] [-c cachefile] [-i] <dir>
+ *
+ * By default every subdirectory is sized by a forked child that reports its
+ * total through a pipe. With -j the tree is walked by a pool of threads
+ * instead; see parallel_dir_size. -u stats entries through io_uring, a
+ * batch at a time, -c keeps what each directory held between runs in
+ * cachefile (see cache_load), and -i counts a file with several hard links
+ * once rather than once per link. They need the thread walk, which they
+ * turn on with one thread per CPU unless -j is given.
+ *
+ * Both walks work on directory file descriptors: entries are read in
+ * getdents64 batches and looked up relative to their directory, so no path
+ * is ever built and the tree can be arbitrarily deep. Symbolic links are
+ * followed.
+ */
+unsigned long calculate_dir_size(int dfd);
+unsigned long parallel_dir_size(const char *path, int nthreads);
+
+static int use_uring;
+static const char *cache_path;
+static int count_inodes;
+
+static void fail(void) {
+    printf("Unable to execute\n");
+    exit(1);
+}
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        printf("Unable to execute\n");
-        exit(1);
+    int nthreads = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:uc:i")) != -1) {
+        if (opt == 'u') {
+            use_uring = 1;
+        } else if (opt == 'c') {
+            cache_path = optarg;
+        } else if (opt == 'i') {
+            count_inodes = 1;
+        } else if (opt != 'j' || (nthreads = atoi(optarg)) < 1) {
+            fail();
+        }
     }
+    if (optind != argc - 1) fail();
+    if ((use_uring || cache_path || count_inodes) && !nthreads) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
 
-    int pipefd[2];
-    pipe(pipefd);
+    unsigned long size;
+    if (nthreads) {
+        size = parallel_dir_size(argv[optind], nthreads);
+    } else {
+        int fd = open(argv[optind], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) fail();
+        size = calculate_dir_size(fd);
+    }
 
-    unsigned long size = calculate_dir_size(argv[1], pipefd[1]);
-    
     printf("%lu\n", size);
-    
+
     return 0;
 }
 
-unsigned long calculate_dir_size(const char *path, int write_pipe) {
-    DIR *dir;
-    struct dirent *entry;
+struct linux_dirent64 {
+    ino_t d_ino;
+    off_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+#define DENTS_BUF (32 * 1024)
+
+// Reads the next batch of entries of the directory fd; 0 at the end
+static long read_dents(int fd, char *buf) {
+    long n = syscall(SYS_getdents64, fd, buf, DENTS_BUF);
+    if (n == -1) fail();
+    return n;
+}
+
+static int is_dot(const char *name) {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+#define ENTRY_FILE 0        // sized, nothing to descend into
+#define ENTRY_DIR 1         // a directory
+#define ENTRY_DIR_LINK 2    // a symbolic link to a directory
+
+/*
+ * Classifies one entry of the directory open as dfd. For ENTRY_FILE,
+ * *statbuf describes what is to be counted, the target in the case of a
+ * link. A directory is known from d_type alone; its size is taken once it
+ * has been opened.
+ */
+static int classify(int dfd, const char *name, unsigned char type, struct stat *statbuf) {
+    if (type == DT_DIR) return ENTRY_DIR;
+    if (type != DT_LNK) {
+        if (fstatat(dfd, name, statbuf, AT_SYMLINK_NOFOLLOW) == -1) fail();
+        if (S_ISDIR(statbuf->st_mode)) return ENTRY_DIR;
+        if (!S_ISLNK(statbuf->st_mode)) return ENTRY_FILE;
+    }
+
+    if (fstatat(dfd, name, statbuf, 0) == -1) fail();
+    return S_ISDIR(statbuf->st_mode) ? ENTRY_DIR_LINK : ENTRY_FILE;
+}
+
+static int open_dir(int dfd, const char *name, int kind) {
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    if (kind == ENTRY_DIR) flags |= O_NOFOLLOW;
+
+    int fd = openat(dfd, name, flags);
+    if (fd == -1) fail();
+    return fd;
+}
+
+// Pipe this process reports its total on, if it is a child
+static int report_fd = -1;
+
+/*
+ * Sizes the directory open as dfd and closes it. A child carries on below
+ * its parent's frames, so the stack grows with depth; the entry buffer is
+ * kept off it.
+ */
+unsigned long calculate_dir_size(int dfd) {
+    char *buf = malloc(DENTS_BUF);
     struct stat statbuf;
     unsigned long total_size = 0;
+    long n;
+
+    if (buf == NULL) fail();
+    while ((n = read_dents(dfd, buf)) > 0) {
+        for (long off = 0; off < n; ) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *)(buf + off);
+            off += entry->d_reclen;
+            if (is_dot(entry->d_name)) {
+                continue;
+            }
+
+            int kind = classify(dfd, entry->d_name, entry->d_type, &statbuf);
 
-    if ((dir = opendir(path)) == NULL) {
-        printf("Unable to execute\n");
-        exit(1);
+            if (kind == ENTRY_FILE) {
+                total_size += statbuf.st_size;
+            }
+            else if (kind == ENTRY_DIR_LINK) {
+                total_size += calculate_dir_size(open_dir(dfd, entry->d_name, kind));
+            }
+            else if (kind == ENTRY_DIR) {
+                int subfd = open_dir(dfd, entry->d_name, kind);
+                int pipefd[2];
+                pipe(pipefd);
+
+                pid_t pid = fork();
+                if (pid == 0) {  // Child
+                    // Keep only this level's descriptors, however deep the tree
+                    close(pipefd[0]);
+                    close(dfd);
+                    if (report_fd != -1) close(report_fd);
+                    report_fd = pipefd[1];
+                    unsigned long size = calculate_dir_size(subfd);
+                    write(pipefd[1], &size, sizeof(size));
+                    close(pipefd[1]);
+                    exit(0);
+                } else {  // Parent
+                    unsigned long sub_size = 0;
+                    close(pipefd[1]);
+                    close(subfd);
+                    read(pipefd[0], &sub_size, sizeof(sub_size));
+                    close(pipefd[0]);
+                    //wait(NULL); // Wait for the child to exit
+                    total_size += sub_size;
+                }
+            }
+        }
     }
 
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
+    if (fstat(dfd, &statbuf) == -1) fail();
+    close(dfd);
+    free(buf);
+
+    total_size += statbuf.st_size;
+    return total_size;
+}
+
+/*
+ * Parallel traversal. Every worker owns a deque of directories still to be
+ * read: it pushes the subdirectories it finds and pops them back from the
+ * same end, so it keeps walking depth first on a warm path, while an idle
+ * worker steals from the other end, which holds the oldest and usually the
+ * largest subtrees. Each worker sums into its own counter; the counters are
+ * added up once every worker has stopped.
+ *
+ * A queued directory is only a name in its parent, which stays open until
+ * all of its subdirectories have been opened. Descriptors are held for
+ * directories being read or with children still queued, never for every
+ * queued directory.
+ */
+struct work {
+    struct work *parent;
+    int fd;             // open while read or while children are queued
+    int kind;           // ENTRY_DIR or ENTRY_DIR_LINK
+    unsigned int refs;  // queued children, plus one while being read
+    char name[];
+};
+
+/*
+ * A worker's io_uring, driven through the raw system calls. Each batch of
+ * directory entries that need a stat is queued as STATX requests and
+ * submitted with one io_uring_enter, which also waits for the results: one
+ * system call per batch instead of one per entry, and the kernel is free to
+ * carry the requests out concurrently.
+ * fd is -1 when io_uring is unavailable, and the worker stats entries one
+ * at a time instead.
+ */
+#define RING_ENTRIES 256
+
+struct uring {
+    int fd;
+    unsigned int sq_tail;           // local copy, published on submit
+    unsigned int *sq_head_p, *sq_tail_p, *sq_mask, *sq_array;
+    unsigned int *cq_head_p, *cq_tail_p, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    struct statx stx[RING_ENTRIES];
+    const char *name[RING_ENTRIES];
+    unsigned char type[RING_ENTRIES];
+};
+
+static int uring_init(struct uring *r) {
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (r->fd == -1) return -1;
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_size > sq_size) sq_size = cq_size;
+        cq_size = sq_size;
+    }
+
+    void *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    void *cq = sq;
+    if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || r->sqes == MAP_FAILED) {
+        close(r->fd);
+        r->fd = -1;
+        return -1;
+    }
+
+    r->sq_head_p = sq + p.sq_off.head;
+    r->sq_tail_p = sq + p.sq_off.tail;
+    r->sq_mask = sq + p.sq_off.ring_mask;
+    r->sq_array = sq + p.sq_off.array;
+    r->cq_head_p = cq + p.cq_off.head;
+    r->cq_tail_p = cq + p.cq_off.tail;
+    r->cq_mask = cq + p.cq_off.ring_mask;
+    r->cqes = cq + p.cq_off.cqes;
+    r->sq_tail = *r->sq_tail_p;
+    return 0;
+}
+
+// Queues a statx of name in dfd into slot i; links are followed for DT_LNK
+static void uring_statx(struct uring *r, unsigned int i, int dfd, const char *name, unsigned char type) {
+    unsigned int idx = r->sq_tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dfd;
+    sqe->addr = (unsigned long)name;
+    sqe->len = STATX_TYPE | STATX_SIZE | STATX_NLINK | STATX_INO;
+    sqe->off = (unsigned long)&r->stx[i];
+    sqe->statx_flags = type == DT_LNK ? 0 : AT_SYMLINK_NOFOLLOW;
+    sqe->user_data = i;
+    r->sq_array[idx] = idx;
+    r->name[i] = name;
+    r->type[i] = type;
+    r->sq_tail++;
+}
+
+// Submits everything queued and waits until n results are in
+static void uring_wait(struct uring *r, unsigned int n) {
+    __atomic_store_n(r->sq_tail_p, r->sq_tail, __ATOMIC_RELEASE);
+    for (;;) {
+        unsigned int queued = r->sq_tail - __atomic_load_n(r->sq_head_p, __ATOMIC_ACQUIRE);
+        unsigned int ready = __atomic_load_n(r->cq_tail_p, __ATOMIC_ACQUIRE) - *r->cq_head_p;
+        if (queued == 0 && ready >= n) return;
+        if (syscall(__NR_io_uring_enter, r->fd, queued, n - ready, IORING_ENTER_GETEVENTS, NULL, 0) == -1 &&
+            errno != EINTR) {
+            fail();
+        }
+    }
+}
+
+struct outbuf {
+    char *data;
+    size_t len, cap;
+};
+
+struct deque {
+    pthread_mutex_t lock;
+    struct work **items;
+    unsigned long head, tail, cap;      // items[head..tail) are queued
+};
+
+struct worker {
+    pthread_t tid;
+    struct deque dq;
+    unsigned long total;
+    unsigned int seed;
+    struct uring *ring;     // NULL unless -u
+    struct outbuf cache_out;        // -c records of the directories read
+    unsigned long ncached;
+    size_t rec;                     // offset of the record being filled
+    struct outbuf links;            // its hard-linked files so far
+    unsigned long linked;           // and the bytes counted for them
+};
+
+static struct worker *workers;
+static int nworkers;
+
+// Directories queued or being read; the walk is over when it drops to 0
+static unsigned long pending;
+
+// Workers with nothing to do sleep on idle_cond until work shows up
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static int nidle;
+
+static struct work *new_work(struct work *parent, const char *name, int kind) {
+    struct work *w = malloc(sizeof(struct work) + strlen(name) + 1);
+    if (w == NULL) fail();
+    w->parent = parent;
+    w->fd = -1;
+    w->kind = kind;
+    w->refs = 1;
+    strcpy(w->name, name);
+    if (parent) __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+    return w;
+}
+
+static void put_work(struct work *w) {
+    if (__atomic_sub_fetch(&w->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(w->fd);
+        free(w);
+    }
+}
+
+static void push(struct worker *self, struct work *w) {
+    struct deque *dq = &self->dq;
+
+    __atomic_add_fetch(&pending, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail == dq->cap) {
+        // Slide the live part down before growing
+        unsigned long n = dq->tail - dq->head;
+        if (dq->head && dq->head >= dq->cap / 2) {
+            memmove(dq->items, dq->items + dq->head, n * sizeof(*dq->items));
+        } else {
+            dq->cap = dq->cap ? dq->cap * 2 : 64;
+            struct work **items = malloc(dq->cap * sizeof(*items));
+            if (items == NULL) fail();
+            if (n) memcpy(items, dq->items + dq->head, n * sizeof(*items));
+            free(dq->items);
+            dq->items = items;
+        }
+        dq->head = 0;
+        dq->tail = n;
+    }
+    dq->items[dq->tail++] = w;
+    pthread_mutex_unlock(&dq->lock);
+
+    if (__atomic_load_n(&nidle, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+// Owner end: newest first
+static struct work *pop(struct worker *self) {
+    struct deque *dq = &self->dq;
+    struct work *w = NULL;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail > dq->head) w = dq->items[--dq->tail];
+    pthread_mutex_unlock(&dq->lock);
+    return w;
+}
+
+// Thief end: oldest first, trying every other worker from a random start
+static struct work *steal(struct worker *self) {
+    int start = rand_r(&self->seed) % nworkers;
+
+    for (int i = 0; i < nworkers; i++) {
+        struct deque *dq = &workers[(start + i) % nworkers].dq;
+        struct work *w = NULL;
+
+        if (dq == &self->dq) continue;
+        pthread_mutex_lock(&dq->lock);
+        if (dq->tail > dq->head) w = dq->items[dq->head++];
+        pthread_mutex_unlock(&dq->lock);
+        if (w) return w;
+    }
+    return NULL;
+}
+
+/*
+ * Inodes with more than one link that have been counted, for -i. The set is
+ * split by hash into shards, each an open-addressing table of (dev, ino)
+ * with its own lock, so workers seldom wait on each other. Only files with
+ * st_nlink > 1 are entered and an entry is just the two numbers; inode 0,
+ * which no file has, marks a free slot.
+ */
+#define INODE_SHARDS 64
+
+struct inode_key {
+    uint64_t dev, ino;
+};
+
+struct inode_shard {
+    pthread_mutex_t lock;
+    struct inode_key *keys;
+    unsigned long cap, count;
+} __attribute__((aligned(64)));
+
+static struct inode_shard inode_set[INODE_SHARDS];
+
+static uint64_t inode_hash(uint64_t dev, uint64_t ino) {
+    uint64_t h = (ino ^ dev * 0x9e3779b97f4a7c15UL) * 0xff51afd7ed558ccdUL;
+    return h ^ h >> 32;
+}
+
+static void inode_put(struct inode_shard *sh, uint64_t h, uint64_t dev, uint64_t ino) {
+    unsigned long i = (h / INODE_SHARDS) & (sh->cap - 1);
+
+    while (sh->keys[i].ino) i = (i + 1) & (sh->cap - 1);
+    sh->keys[i].dev = dev;
+    sh->keys[i].ino = ino;
+    sh->count++;
+}
+
+// Adds (dev, ino) to the set; returns 1 if it was not there yet
+static int inode_add(uint64_t dev, uint64_t ino) {
+    uint64_t h = inode_hash(dev, ino);
+    struct inode_shard *sh = &inode_set[h % INODE_SHARDS];
+    int added = 1;
+
+    pthread_mutex_lock(&sh->lock);
+    for (unsigned long i = (h / INODE_SHARDS) & (sh->cap - 1); sh->cap && sh->keys[i].ino; i = (i + 1) & (sh->cap - 1)) {
+        if (sh->keys[i].ino == ino && sh->keys[i].dev == dev) {
+            added = 0;
+            break;
+        }
+    }
+    if (added) {
+        // Grow at three quarters full
+        if (4 * (sh->count + 1) > 3 * sh->cap) {
+            struct inode_key *old = sh->keys;
+            unsigned long old_cap = sh->cap;
+
+            sh->cap = old_cap ? old_cap * 2 : 256;
+            sh->keys = calloc(sh->cap, sizeof(struct inode_key));
+            if (sh->keys == NULL) fail();
+            sh->count = 0;
+            for (unsigned long i = 0; i < old_cap; i++) {
+                if (old[i].ino) inode_put(sh, inode_hash(old[i].dev, old[i].ino), old[i].dev, old[i].ino);
+            }
+            free(old);
+        }
+        inode_put(sh, h, dev, ino);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return added;
+}
+
+/*
+ * Directory cache for -c. For every directory of the last walk it holds the
+ * directory's identity and timestamps, the size of the directory with its
+ * non-directory entries, and the names of its subdirectories. Files with
+ * more than one link are listed apart, by (dev, ino) and size, so that -i
+ * can still count each of them once. A directory
+ * whose mtime and ctime have not moved since still has the same entries,
+ * so its size is taken from the record and its subdirectories are queued
+ * from it, without reading the directory or stat'ing anything in it.
+ *
+ * The subdirectories themselves are still visited (one fstat each), because
+ * a change below a directory does not touch its timestamps. For the same
+ * reason a file rewritten in place keeps its old size until something in
+ * its directory is added, removed or renamed.
+ *
+ * The file is CACHE_MAGIC and a record count, then the records. Each is
+ * followed by its subdirectories as a kind byte and a NUL-terminated name,
+ * padded to 8 bytes, then by its hard-linked files. It is rewritten after
+ * every walk.
+ */
+#define CACHE_MAGIC "MYDUC002"
+
+struct cache_rec {
+    uint64_t dev, ino;
+    int64_t mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+    uint64_t size;          // without the hard-linked files
+    uint32_t nsub;          // subdirectories following
+    uint32_t nlinks;        // hard-linked files after them
+    uint64_t len;           // bytes both take
+};
+
+struct cache_link {
+    uint64_t dev, ino, size;
+};
+
+// The records of the last walk by (dev, ino), open addressing
+static struct cache_rec **cache;
+static unsigned long cache_cap;
+
+static unsigned long cache_hash(uint64_t dev, uint64_t ino) {
+    return ((ino ^ dev << 32) * 0x9e3779b97f4a7c15UL >> 32) & (cache_cap - 1);
+}
+
+// A record is used only if its lists are well formed
+static int cache_rec_ok(struct cache_rec *rec) {
+    if (rec->len % 8 || rec->nlinks > rec->len / sizeof(struct cache_link)) return 0;
+
+    char *p = (char *)(rec + 1);
+    char *end = p + rec->len - rec->nlinks * sizeof(struct cache_link);
+
+    for (uint32_t i = 0; i < rec->nsub; i++) {
+        if (end - p < 3 || (p[0] != ENTRY_DIR && p[0] != ENTRY_DIR_LINK)) return 0;
+        char *nul = memchr(p + 1, '\0', end - p - 1);
+        if (nul == NULL || nul == p + 1) return 0;
+        p = nul + 1;
+    }
+    return 1;
+}
+
+// A missing or unreadable cache file is an empty cache
+static void cache_load(void) {
+    struct stat sb;
+    int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) return;
+    if (fstat(fd, &sb) == -1 || sb.st_size < 16) {
+        close(fd);
+        return;
+    }
+    char *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+    if (memcmp(map, CACHE_MAGIC, 8) != 0) {
+        munmap(map, sb.st_size);
+        return;
+    }
+
+    uint64_t n;
+    memcpy(&n, map + 8, sizeof(n));
+    if (n > sb.st_size / sizeof(struct cache_rec)) n = sb.st_size / sizeof(struct cache_rec);
+    for (cache_cap = 1024; cache_cap < 2 * n; cache_cap *= 2);
+    cache = calloc(cache_cap, sizeof(*cache));
+    if (cache == NULL) fail();
+
+    char *p = map + 16, *end = map + sb.st_size;
+    for (uint64_t i = 0; i < n; i++) {
+        struct cache_rec *rec = (struct cache_rec *)p;
+        if ((size_t)(end - p) < sizeof(*rec) || (size_t)(end - p) - sizeof(*rec) < rec->len ||
+            !cache_rec_ok(rec)) {
+            break;
+        }
+        unsigned long h = cache_hash(rec->dev, rec->ino);
+        while (cache[h]) h = (h + 1) & (cache_cap - 1);
+        cache[h] = rec;
+        p += sizeof(*rec) + rec->len;
+    }
+}
+
+static struct cache_rec *cache_find(struct stat *statbuf) {
+    if (cache == NULL) return NULL;
+    for (unsigned long h = cache_hash(statbuf->st_dev, statbuf->st_ino); cache[h]; h = (h + 1) & (cache_cap - 1)) {
+        struct cache_rec *rec = cache[h];
+        if (rec->dev == statbuf->st_dev && rec->ino == statbuf->st_ino) {
+            return rec;
+        }
+    }
+    return NULL;
+}
+
+// Room for n more bytes at the end of b; returns their offset
+static size_t out_grow(struct outbuf *b, size_t n) {
+    if (b->len + n > b->cap) {
+        while (b->len + n > b->cap) b->cap = b->cap ? b->cap * 2 : 65536;
+        b->data = realloc(b->data, b->cap);
+        if (b->data == NULL) fail();
+    }
+    b->len += n;
+    return b->len - n;
+}
+
+// Starts this walk's record of the directory described by statbuf
+static void cache_begin(struct worker *self, struct stat *statbuf) {
+    self->rec = out_grow(&self->cache_out, sizeof(struct cache_rec));
+    struct cache_rec *rec = (struct cache_rec *)(self->cache_out.data + self->rec);
+
+    memset(rec, 0, sizeof(*rec));
+    rec->dev = statbuf->st_dev;
+    rec->ino = statbuf->st_ino;
+    rec->mtime_sec = statbuf->st_mtim.tv_sec;
+    rec->mtime_nsec = statbuf->st_mtim.tv_nsec;
+    rec->ctime_sec = statbuf->st_ctim.tv_sec;
+    rec->ctime_nsec = statbuf->st_ctim.tv_nsec;
+    self->ncached++;
+    self->links.len = 0;
+    self->linked = 0;
+}
+
+static void cache_add_subdir(struct worker *self, const char *name, int kind) {
+    size_t len = strlen(name) + 1;
+    size_t off = out_grow(&self->cache_out, len + 1);
+
+    self->cache_out.data[off] = kind;
+    memcpy(self->cache_out.data + off + 1, name, len);
+    ((struct cache_rec *)(self->cache_out.data + self->rec))->nsub++;
+}
+
+static void cache_add_link(struct worker *self, struct stat *statbuf) {
+    struct cache_link link = { statbuf->st_dev, statbuf->st_ino, statbuf->st_size };
+    size_t off = out_grow(&self->links, sizeof(link));
+
+    memcpy(self->links.data + off, &link, sizeof(link));
+}
+
+// Completes the record; size counts everything but the hard-linked files
+static void cache_end(struct worker *self, unsigned long size) {
+    struct outbuf *b = &self->cache_out;
+
+    out_grow(b, (8 - b->len % 8) % 8);
+    if (self->links.len) {
+        size_t off = out_grow(b, self->links.len);
+        memcpy(b->data + off, self->links.data, self->links.len);
+    }
+    struct cache_rec *rec = (struct cache_rec *)(b->data + self->rec);
+    rec->size = size - self->linked;
+    rec->nlinks = self->links.len / sizeof(struct cache_link);
+    rec->len = b->len - self->rec - sizeof(*rec);
+}
+
+// Counts a file with several links, unless -i has seen it already
+static unsigned long count_link(struct worker *self, uint64_t dev, uint64_t ino, uint64_t size) {
+    if (count_inodes && !inode_add(dev, ino)) return 0;
+    self->total += size;
+    return size;
+}
+
+static void count_file(struct worker *self, struct stat *statbuf) {
+    if (statbuf->st_nlink < 2) {
+        self->total += statbuf->st_size;
+        return;
+    }
+    if (cache_path) cache_add_link(self, statbuf);
+    self->linked += count_link(self, statbuf->st_dev, statbuf->st_ino, statbuf->st_size);
+}
+
+/*
+ * Sizes the directory from its record, if the record is still good, and
+ * queues the subdirectories listed there.
+ */
+static int cache_reuse(struct worker *self, struct work *w, struct stat *statbuf) {
+    struct cache_rec *rec = cache_find(statbuf);
+
+    if (rec == NULL || rec->mtime_sec != statbuf->st_mtim.tv_sec || rec->mtime_nsec != statbuf->st_mtim.tv_nsec ||
+        rec->ctime_sec != statbuf->st_ctim.tv_sec || rec->ctime_nsec != statbuf->st_ctim.tv_nsec) {
+        return 0;
+    }
+
+    size_t off = out_grow(&self->cache_out, sizeof(*rec) + rec->len);
+    memcpy(self->cache_out.data + off, rec, sizeof(*rec) + rec->len);
+    self->ncached++;
+    self->total += rec->size;
+
+    struct cache_link *link = (struct cache_link *)((char *)(rec + 1) + rec->len) - rec->nlinks;
+    for (uint32_t i = 0; i < rec->nlinks; i++) {
+        count_link(self, link[i].dev, link[i].ino, link[i].size);
+    }
+
+    char *p = (char *)(rec + 1);
+    for (uint32_t i = 0; i < rec->nsub; i++) {
+        push(self, new_work(w, p + 1, p[0]));
+        p += strlen(p + 1) + 2;
+    }
+    return 1;
+}
+
+static void write_all(int fd, const void *buf, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) fail();
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+}
+
+// Replaces the cache file with this walk's records, atomically
+static void cache_save(void) {
+    size_t len = strlen(cache_path);
+    char *tmp = malloc(len + 5);
+    uint64_t n = 0;
+
+    if (tmp == NULL) fail();
+    memcpy(tmp, cache_path, len);
+    strcpy(tmp + len, ".tmp");
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) fail();
+    for (int i = 0; i < nworkers; i++) {
+        n += workers[i].ncached;
+    }
+    write_all(fd, CACHE_MAGIC, 8);
+    write_all(fd, &n, sizeof(n));
+    for (int i = 0; i < nworkers; i++) {
+        write_all(fd, workers[i].cache_out.data, workers[i].cache_out.len);
+    }
+    if (close(fd) == -1 || rename(tmp, cache_path) == -1) fail();
+    free(tmp);
+}
+
+// Queues a subdirectory of w, noting it in w's cache record
+static void descend(struct worker *self, struct work *w, const char *name, int kind) {
+    if (cache_path) cache_add_subdir(self, name, kind);
+    push(self, new_work(w, name, kind));
+}
+
+/*
+ * Stats the n entries queued on the worker's ring, then sizes or queues each
+ * one as classify would. A request the kernel could not carry out, say for
+ * lack of STATX support, is redone synchronously.
+ */
+static void uring_classify(struct worker *self, struct work *w, unsigned int n) {
+    struct uring *r = self->ring;
+
+    uring_wait(r, n);
+    for (unsigned int head = *r->cq_head_p; n; n--, head++) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        unsigned int i = cqe->user_data;
+        struct statx *stx = &r->stx[i];
+        struct stat statbuf;
+        int kind;
+
+        if (cqe->res < 0 || S_ISLNK(stx->stx_mode)) {
+            kind = classify(w->fd, r->name[i], r->type[i], &statbuf);
+        } else if (S_ISDIR(stx->stx_mode)) {
+            kind = r->type[i] == DT_LNK ? ENTRY_DIR_LINK : ENTRY_DIR;
+        } else {
+            statbuf.st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+            statbuf.st_ino = stx->stx_ino;
+            statbuf.st_nlink = stx->stx_nlink;
+            statbuf.st_size = stx->stx_size;
+            kind = ENTRY_FILE;
+        }
+        if (kind == ENTRY_FILE) {
+            count_file(self, &statbuf);
+        } else {
+            descend(self, w, r->name[i], kind);
         }
+        __atomic_store_n(r->cq_head_p, head + 1, __ATOMIC_RELEASE);
+    }
+}
 
-        char full_path[1024];
-        snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
-
-        if (lstat(full_path, &statbuf) == -1) {
-            printf("Unable to execute\n");
-            exit(1);
-        }
-
-        if (S_ISLNK(statbuf.st_mode)) {
-            total_size += calculate_dir_size(full_path, write_pipe);
-        } 
-        else if (S_ISDIR(statbuf.st_mode)) {
-            int pipefd[2];
-            pipe(pipefd);
-            
-            pid_t pid = fork();
-            if (pid == 0) {  // Child
-                close(pipefd[0]);
-                unsigned long size = calculate_dir_size(full_path, pipefd[1]);
-                write(pipefd[1], &size, sizeof(size));
-                close(pipefd[1]);
-                exit(0);
-            } else {  // Parent
-                unsigned long sub_size = 0;
-                close(pipefd[1]);
-                read(pipefd[0], &sub_size, sizeof(sub_size));
-                close(pipefd[0]);
-                //wait(NULL); // Wait for the child to exit
-                total_size += sub_size;
+// Sizes the entries of one directory and queues its subdirectories
+static void scan_dir(struct worker *self, struct work *w) {
+    char buf[DENTS_BUF];
+    struct stat statbuf;
+    unsigned int queued = 0;
+    long n;
+
+    w->fd = open_dir(w->parent ? w->parent->fd : AT_FDCWD, w->name, w->kind);
+    if (w->parent) put_work(w->parent);
+    if (fstat(w->fd, &statbuf) == -1) fail();
+    if (cache_path) {
+        if (cache_reuse(self, w, &statbuf)) {
+            put_work(w);
+            return;
+        }
+        cache_begin(self, &statbuf);
+    }
+
+    unsigned long start = self->total;
+    self->total += statbuf.st_size;
+
+    while ((n = read_dents(w->fd, buf)) > 0) {
+        for (long off = 0; off < n; ) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *)(buf + off);
+            off += entry->d_reclen;
+            if (is_dot(entry->d_name)) {
+                continue;
+            }
+
+            if (self->ring && entry->d_type != DT_DIR) {
+                uring_statx(self->ring, queued++, w->fd, entry->d_name, entry->d_type);
+                if (queued == RING_ENTRIES) {
+                    uring_classify(self, w, queued);
+                    queued = 0;
+                }
+                continue;
+            }
+
+            int kind = classify(w->fd, entry->d_name, entry->d_type, &statbuf);
+            if (kind == ENTRY_FILE) {
+                count_file(self, &statbuf);
+            } else {
+                descend(self, w, entry->d_name, kind);
             }
-        } 
-        else {
-            total_size += statbuf.st_size;
         }
+
+        // The names live in buf, so the batch is finished before the next read
+        if (queued) uring_classify(self, w, queued);
+        queued = 0;
     }
 
-    closedir(dir);
+    if (cache_path) cache_end(self, self->total - start);
+    put_work(w);
+}
+
+static void *worker_main(void *arg) {
+    struct worker *self = arg;
 
-    if (stat(path, &statbuf) == -1) {
-        printf("Unable to execute\n");
-        exit(1);
+    for (;;) {
+        struct work *w = pop(self);
+        if (w == NULL) w = steal(self);
+
+        if (w) {
+            scan_dir(self, w);
+            if (__atomic_sub_fetch(&pending, 1, __ATOMIC_ACQ_REL) == 0) {
+                pthread_mutex_lock(&idle_lock);
+                pthread_cond_broadcast(&idle_cond);
+                pthread_mutex_unlock(&idle_lock);
+            }
+            continue;
+        }
+
+        // Nothing to steal: sleep until a push or the end of the walk. A push
+        // that raced with falling asleep is noticed on the next tick.
+        pthread_mutex_lock(&idle_lock);
+        if (__atomic_load_n(&pending, __ATOMIC_ACQUIRE) == 0) {
+            pthread_mutex_unlock(&idle_lock);
+            break;
+        }
+        __atomic_add_fetch(&nidle, 1, __ATOMIC_RELAXED);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&idle_cond, &idle_lock, &ts);
+        __atomic_sub_fetch(&nidle, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&idle_lock);
     }
+    return NULL;
+}
 
-    total_size += statbuf.st_size;
-    write(write_pipe, &total_size, sizeof(total_size));
-    return total_size;
-}
\ No newline at end of file
+unsigned long parallel_dir_size(const char *path, int nthreads) {
+    unsigned long total = 0;
+
+    if (cache_path) cache_load();
+    for (int i = 0; i < INODE_SHARDS; i++) {
+        pthread_mutex_init(&inode_set[i].lock, NULL);
+    }
+
+    nworkers = nthreads;
+    workers = calloc(nworkers, sizeof(struct worker));
+    if (workers == NULL) fail();
+    for (int i = 0; i < nworkers; i++) {
+        pthread_mutex_init(&workers[i].dq.lock, NULL);
+        workers[i].seed = i + 1;
+        if (use_uring) {
+            workers[i].ring = malloc(sizeof(struct uring));
+            if (workers[i].ring == NULL) fail();
+            if (uring_init(workers[i].ring) == -1) {
+                free(workers[i].ring);
+                workers[i].ring = NULL;
+            }
+        }
+    }
+
+    // The root is opened relative to the working directory, following links
+    push(&workers[0], new_work(NULL, path, ENTRY_DIR_LINK));
+
+    for (int i = 0; i < nworkers; i++) {
+        if (pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]) != 0) fail();
+    }
+    for (int i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].tid, NULL);
+        total += workers[i].total;
+    }
+    if (cache_path) cache_save();
+    return total;
+}
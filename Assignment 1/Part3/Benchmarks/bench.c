@@ -0,0 +1,321 @@
+/*
+ * Allocator benchmark. Built twice by `make bench`: against memalloc
+ * (-DUSE_MEMALLOC) and against the C library's malloc. Every workload runs
+ * in its own child process so peak RSS is measured per workload.
+ *
+ * Reported per workload:
+ *   ops/s  allocation + free calls per second
+ *   p99    99th percentile latency of a single call in ns, sampled 1 in 16
+ *   rss    peak resident set of the child
+ *   frag   (peak RSS - RSS at start) / peak bytes live at the same time
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#ifdef USE_MEMALLOC
+#include "../mylib.h"
+#define ALLOC(n) memalloc(n)
+#define FREE(p) memfree(p)
+#define ALLOCATOR "memalloc"
+#else
+#define ALLOC(n) malloc(n)
+#define FREE(p) free(p)
+#define ALLOCATOR "malloc"
+#endif
+
+#define SAMPLE_EVERY 16
+#define MAX_SAMPLES (1 << 20)
+#define NTHREADS 4
+
+static unsigned long nops = 1000000;
+
+// Latency samples and live-byte accounting, shared by all threads of a run
+static unsigned long samples[MAX_SAMPLES];
+static unsigned long nsamples;
+static unsigned long live_bytes, peak_live, total_ops;
+
+static inline unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static inline unsigned long xorshift(unsigned long *state) {
+    unsigned long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static void record(unsigned long ns) {
+    unsigned long i = __atomic_fetch_add(&nsamples, 1, __ATOMIC_RELAXED);
+    if (i < MAX_SAMPLES) samples[i] = ns;
+}
+
+static void account(long delta) {
+    __atomic_fetch_add(&total_ops, 1, __ATOMIC_RELAXED);
+    unsigned long live = __atomic_add_fetch(&live_bytes, delta, __ATOMIC_RELAXED);
+    unsigned long peak = __atomic_load_n(&peak_live, __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&peak_live, &peak, live, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// Allocate / free with every SAMPLE_EVERY-th call timed
+static void *bench_alloc(unsigned long size, unsigned long op) {
+    void *p;
+    if (op % SAMPLE_EVERY == 0) {
+        unsigned long t = now_ns();
+        p = ALLOC(size);
+        record(now_ns() - t);
+    } else {
+        p = ALLOC(size);
+    }
+    if (!p) {
+        fprintf(stderr, "allocation of %lu bytes failed\n", size);
+        exit(1);
+    }
+    // Touch every page so the footprint shows up in RSS
+    for (unsigned long off = sizeof(unsigned long); off < size; off += 4096)
+        ((char *)p)[off] = 1;
+    *(unsigned long *)p = size;
+    account(size);
+    return p;
+}
+
+static void bench_free(void *p, unsigned long op) {
+    account(-(long)*(unsigned long *)p);
+    if (op % SAMPLE_EVERY == 0) {
+        unsigned long t = now_ns();
+        FREE(p);
+        record(now_ns() - t);
+    } else {
+        FREE(p);
+    }
+}
+
+// Mostly small objects with a long tail, sizes 8 B .. 16 KB
+static unsigned long random_size(unsigned long *rng) {
+    unsigned long r = xorshift(rng);
+    switch (r % 10) {
+    case 0: return 1024 + (r >> 8) % (15 * 1024);
+    case 1: case 2: return 256 + (r >> 8) % 768;
+    default: return 8 + (r >> 8) % 248;
+    }
+}
+
+/* ---- random sizes: one thread, random alloc/free over a fixed slot table ---- */
+
+#define SLOTS 10000
+
+static void run_random(void) {
+    static void *slot[SLOTS];
+    unsigned long rng = 42;
+
+    for (unsigned long op = 0; op < nops; op++) {
+        unsigned long i = xorshift(&rng) % SLOTS;
+        if (slot[i]) {
+            bench_free(slot[i], op);
+            slot[i] = NULL;
+        } else {
+            slot[i] = bench_alloc(random_size(&rng), op);
+        }
+    }
+    for (int i = 0; i < SLOTS; i++)
+        if (slot[i]) bench_free(slot[i], 1);
+}
+
+/* ---- producer/consumer: one thread allocates, another frees ---- */
+
+#define RING 4096
+
+static void *ring[RING];
+static unsigned long ring_head, ring_tail;
+
+static void *producer(void *arg) {
+    unsigned long rng = 7;
+    for (unsigned long op = 0; op < nops / 2; op++) {
+        void *p = bench_alloc(random_size(&rng) % 512 + 8, op);
+        while (ring_tail - __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) == RING)
+            sched_yield();
+        ring[ring_tail % RING] = p;
+        __atomic_store_n(&ring_tail, ring_tail + 1, __ATOMIC_RELEASE);
+    }
+    return arg;
+}
+
+static void *consumer(void *arg) {
+    for (unsigned long op = 0; op < nops / 2; op++) {
+        while (__atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) == ring_head)
+            sched_yield();
+        bench_free(ring[ring_head % RING], op);
+        __atomic_store_n(&ring_head, ring_head + 1, __ATOMIC_RELEASE);
+    }
+    return arg;
+}
+
+static void run_prodcons(void) {
+    pthread_t p, c;
+    pthread_create(&p, NULL, producer, NULL);
+    pthread_create(&c, NULL, consumer, NULL);
+    pthread_join(p, NULL);
+    pthread_join(c, NULL);
+}
+
+/*
+ * ---- larson: threads replace random objects in their own table; after each
+ * round every table moves on to the next thread, so objects die in a
+ * different thread from the one that allocated them ----
+ */
+
+#define LARSON_SLOTS 2000
+#define LARSON_ROUNDS 10
+
+static void *larson_table[NTHREADS][LARSON_SLOTS];
+static pthread_barrier_t larson_barrier;
+
+static void *larson_worker(void *arg) {
+    long id = (long)arg;
+    unsigned long rng = 1000 + id;
+    unsigned long per_round = nops / NTHREADS / LARSON_ROUNDS / 2;
+    unsigned long op = 0;
+
+    for (int round = 0; round < LARSON_ROUNDS; round++) {
+        void **table = larson_table[(id + round) % NTHREADS];
+        for (unsigned long n = 0; n < per_round; n++, op++) {
+            unsigned long i = xorshift(&rng) % LARSON_SLOTS;
+            if (table[i]) bench_free(table[i], op);
+            table[i] = bench_alloc(16 + xorshift(&rng) % 113, op);
+        }
+        pthread_barrier_wait(&larson_barrier);
+    }
+    return NULL;
+}
+
+static void run_larson(void) {
+    pthread_t tid[NTHREADS];
+
+    pthread_barrier_init(&larson_barrier, NULL, NTHREADS);
+    for (long i = 0; i < NTHREADS; i++)
+        pthread_create(&tid[i], NULL, larson_worker, (void *)i);
+    for (int i = 0; i < NTHREADS; i++)
+        pthread_join(tid[i], NULL);
+    for (int t = 0; t < NTHREADS; t++)
+        for (int i = 0; i < LARSON_SLOTS; i++)
+            if (larson_table[t][i]) bench_free(larson_table[t][i], 1);
+}
+
+/*
+ * ---- trace replay: a synthetic trace with a ramp-up, a steady phase and a
+ * teardown, generated up front and replayed op by op ----
+ */
+
+struct trace_op {
+    unsigned char op;           // 'a' allocate, 'f' free
+    unsigned long size;
+    unsigned long id;
+};
+
+static struct trace_op *trace;
+static unsigned long trace_len, trace_ids;
+
+// Alloc-heavy first third, balanced middle, free-heavy last third
+static void make_trace(void) {
+    unsigned long n = nops, live = 0;
+    unsigned long rng = 99;
+    unsigned long *ids = malloc(n * sizeof(*ids));
+
+    trace = malloc(n * sizeof(*trace));
+    for (unsigned long i = 0; i < n; i++) {
+        unsigned long bias = i < n / 3 ? 80 : i < 2 * n / 3 ? 50 : 15;
+        if (live && xorshift(&rng) % 100 >= bias) {
+            unsigned long j = xorshift(&rng) % live;
+            trace[i] = (struct trace_op){ 'f', 0, ids[j] };
+            ids[j] = ids[--live];
+        } else {
+            trace[i] = (struct trace_op){ 'a', random_size(&rng), trace_ids };
+            ids[live++] = trace_ids++;
+        }
+    }
+    trace_len = n;
+    free(ids);
+}
+
+static void run_trace(void) {
+    void **objs = calloc(trace_ids, sizeof(*objs));
+
+    for (unsigned long i = 0; i < trace_len; i++) {
+        if (trace[i].op == 'a') {
+            objs[trace[i].id] = bench_alloc(trace[i].size, i);
+        } else {
+            bench_free(objs[trace[i].id], i);
+            objs[trace[i].id] = NULL;
+        }
+    }
+    for (unsigned long i = 0; i < trace_ids; i++)
+        if (objs[i]) bench_free(objs[i], 1);
+}
+
+static long rss_kb(void) {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int cmp_ulong(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// setup runs in the child before the baseline RSS is taken
+static void run(const char *name, void (*setup)(void), void (*workload)(void)) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid != 0) {
+        waitpid(pid, NULL, 0);
+        return;
+    }
+
+#ifdef USE_MEMALLOC
+    memopt(MEM_OPT_THREADS, 0);
+#endif
+    if (setup) setup();
+    long base_rss = rss_kb();
+    unsigned long start = now_ns();
+    workload();
+    double secs = (now_ns() - start) / 1e9;
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    unsigned long n = nsamples < MAX_SAMPLES ? nsamples : MAX_SAMPLES;
+    qsort(samples, n, sizeof(samples[0]), cmp_ulong);
+    unsigned long p99 = n ? samples[n * 99 / 100] : 0;
+    double frag = peak_live ? (ru.ru_maxrss - base_rss) * 1024.0 / peak_live : 0;
+
+    printf("%-10s %-9s %12.0f %8lu %10ld %7.2f\n", name, ALLOCATOR, total_ops / secs, p99, ru.ru_maxrss, frag);
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) nops = strtoul(argv[1], NULL, 10);
+
+    printf("%-10s %-9s %12s %8s %10s %7s\n", "workload", "allocator", "ops/s", "p99(ns)", "rss(KB)", "frag");
+    run("random", NULL, run_random);
+    run("prodcons", NULL, run_prodcons);
+    run("larson", NULL, run_larson);
+    run("trace", make_trace, run_trace);
+    return 0;
+}
@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <unistd.h>
+#include "../mylib.h"
+
+#define NUM 1000
+
+//batch allocation hands out one contiguous run; batch free coalesces it back
+void *ptrs[NUM];
+
+int main()
+{
+	struct memstats st;
+	unsigned long n = 0;
+	void *tmp = 0;
+
+	n = memalloc_batch(40, NUM, ptrs);
+	if(n != NUM)
+	{
+		printf("1.Testcase failed\n");
+		return -1;
+	}
+
+	for(int i = 0; i + 1 < NUM; i++)
+	{
+		if((char *)ptrs[i + 1] != (char *)ptrs[i] + 48)
+		{
+			printf("2.Testcase failed\n");
+			return -1;
+		}
+	}
+
+	//scramble the order, memfree_batch sorts it
+	for(int i = 0; i < NUM; i += 2)
+	{
+		tmp = ptrs[i];
+		ptrs[i] = ptrs[NUM - 1 - i];
+		ptrs[NUM - 1 - i] = tmp;
+	}
+
+	if(memfree_batch(ptrs, NUM) != 0)
+	{
+		printf("3.Testcase failed\n");
+		return -1;
+	}
+
+	//everything merged back into the single free chunk of the region
+	memstats(&st);
+	if(st.free_chunks != 1 || st.in_use != 0)
+	{
+		printf("4.Testcase failed\n");
+		return -1;
+	}
+
+	printf("Testcase passed\n");
+	return 0;
+}
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <pthread.h>
+#include "../mylib.h"
+
+#define NALLOC 20000
+#define ROUNDS 20
+
+//cross-thread frees: memory allocated by one thread and freed by a thread of another heap must be reused
+char *ptrs[NALLOC];
+pthread_barrier_t barrier;
+
+unsigned long obj_size(int i)
+{
+	return i % 50 == 0 ? 2000 : 8 + (i % 16) * 8;
+}
+
+void *producer(void *arg)
+{
+	for(int round = 0; round < ROUNDS; round++)
+	{
+		for(int i = 0; i < NALLOC; i++)
+		{
+			ptrs[i] = (char *)memalloc(obj_size(i));
+			if(ptrs[i] == NULL)
+				return (void *)1;
+			ptrs[i][0] = (char)i;
+			ptrs[i][obj_size(i) - 1] = (char)round;
+		}
+		pthread_barrier_wait(&barrier);
+		pthread_barrier_wait(&barrier);
+	}
+	return NULL;
+}
+
+void *consumer(void *arg)
+{
+	void *ret = NULL;
+
+	for(int round = 0; round < ROUNDS; round++)
+	{
+		pthread_barrier_wait(&barrier);
+		for(int i = 0; i < NALLOC; i++)
+		{
+			if(ptrs[i][0] != (char)i || ptrs[i][obj_size(i) - 1] != (char)round)
+				ret = (void *)2;
+			if(memfree(ptrs[i]) != 0)
+				ret = (void *)3;
+		}
+		pthread_barrier_wait(&barrier);
+	}
+	return ret;
+}
+
+int main()
+{
+	pthread_t prod, cons;
+	void *ret1 = 0, *ret2 = 0;
+	struct memstats st;
+
+	if(memopt(MEM_OPT_THREADS, 2) != 0)
+	{
+		printf("1.Testcase failed\n");
+		return -1;
+	}
+
+	pthread_barrier_init(&barrier, NULL, 2);
+	pthread_create(&prod, NULL, producer, NULL);
+	pthread_create(&cons, NULL, consumer, NULL);
+	pthread_join(prod, &ret1);
+	pthread_join(cons, &ret2);
+	if(ret1 != NULL || ret2 != NULL)
+	{
+		printf("2.Testcase failed\n");
+		return -1;
+	}
+
+	//a round fits in one region; reclaimed memory must keep the footprint flat
+	if(memstats(&st) != 0 || st.regions > 3)
+	{
+		printf("3.Testcase failed\n");
+		return -1;
+	}
+
+	printf("Testcase passed\n");
+	return 0;
+}
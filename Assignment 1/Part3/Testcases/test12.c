@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <string.h>
+#include "../mylib.h"
+
+#define NALLOC 100
+
+//huge page backed regions behave like ordinary ones, and hugetlb falls back when the pool is empty
+int main()
+{
+	char *ptrs[NALLOC];
+	struct memstats st;
+
+	if(memopt(MEM_OPT_HUGEPAGES, 3) != -1)
+	{
+		printf("1.Testcase failed\n");
+		return -1;
+	}
+	if(memopt(MEM_OPT_HUGEPAGES, MEM_HUGE_TLB) != 0)
+	{
+		printf("2.Testcase failed\n");
+		return -1;
+	}
+
+	for(int i = 0; i < NALLOC; i++)
+	{
+		ptrs[i] = (char *)memalloc(100000);
+		if(ptrs[i] == NULL)
+		{
+			printf("3.Testcase failed\n");
+			return -1;
+		}
+		memset(ptrs[i], i, 100000);
+	}
+	for(int i = 0; i < NALLOC; i++)
+	{
+		if(ptrs[i][0] != (char)i || ptrs[i][99999] != (char)i)
+		{
+			printf("4.Testcase failed\n");
+			return -1;
+		}
+		memfree(ptrs[i]);
+	}
+
+	//the last region stays mapped and usable after its pages are released
+	if(memstats(&st) != 0 || st.in_use != 0 || st.regions != 1)
+	{
+		printf("5.Testcase failed\n");
+		return -1;
+	}
+	if(memopt(MEM_OPT_HUGEPAGES, MEM_HUGE_THP) != 0)
+	{
+		printf("6.Testcase failed\n");
+		return -1;
+	}
+	ptrs[0] = (char *)memalloc(200000);
+	if(ptrs[0] == NULL || memset(ptrs[0], 1, 200000) != ptrs[0] || memfree(ptrs[0]) != 0)
+	{
+		printf("7.Testcase failed\n");
+		return -1;
+	}
+
+	printf("Testcase passed\n");
+	return 0;
+}
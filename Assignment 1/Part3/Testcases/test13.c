@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../mylib.h"
+
+#define NALLOC 100
+
+//heap profiler: with a one-byte rate every live allocation is sampled at its own size
+char buf[65536];
+
+//read back what memprofile_dump wrote; returns the bytes summed over folded-stack lines
+long dump(int format)
+{
+	int fds[2];
+	long total = 0;
+	int len;
+
+	if(pipe(fds) != 0 || memprofile_dump(fds[1], format) != 0)
+		return -1;
+	close(fds[1]);
+	len = read(fds[0], buf, sizeof(buf) - 1);
+	close(fds[0]);
+	if(len < 0)
+		return -1;
+	buf[len] = '\0';
+
+	if(format != MEM_PROFILE_FOLDED)
+		return 0;
+	for(char *line = strtok(buf, "\n"); line != NULL; line = strtok(NULL, "\n"))
+		total += atol(strrchr(line, ' ') + 1);
+	return total;
+}
+
+int main()
+{
+	char *ptrs[NALLOC];
+
+	if(memprofile_dump(1, MEM_PROFILE_FOLDED) != -1)
+	{
+		printf("1.Testcase failed\n");
+		return -1;
+	}
+	if(memopt(MEM_OPT_PROFILE, 1) != 0)
+	{
+		printf("2.Testcase failed\n");
+		return -1;
+	}
+
+	for(int i = 0; i < NALLOC; i++)
+		ptrs[i] = (char *)memalloc(100);
+	if(dump(MEM_PROFILE_FOLDED) != NALLOC * 100)
+	{
+		printf("3.Testcase failed\n");
+		return -1;
+	}
+	if(dump(MEM_PROFILE_PPROF) != 0 || strncmp(buf, "heap profile: 100: 10000 ", 25) != 0 || strstr(buf, "MAPPED_LIBRARIES:") == NULL)
+	{
+		printf("4.Testcase failed\n");
+		return -1;
+	}
+
+	//freed allocations leave the profile, including those freed in a batch
+	for(int i = 0; i < NALLOC / 2; i++)
+		memfree(ptrs[i]);
+	memfree_batch((void **)ptrs + NALLOC / 2, NALLOC / 4);
+	if(dump(MEM_PROFILE_FOLDED) != NALLOC / 4 * 100)
+	{
+		printf("5.Testcase failed\n");
+		return -1;
+	}
+
+	//sampling off: nothing new is recorded
+	memopt(MEM_OPT_PROFILE, 0);
+	for(int i = 0; i < NALLOC / 2; i++)
+		ptrs[i] = (char *)memalloc(100);
+	if(dump(MEM_PROFILE_FOLDED) != NALLOC / 4 * 100)
+	{
+		printf("6.Testcase failed\n");
+		return -1;
+	}
+
+	printf("Testcase passed\n");
+	return 0;
+}
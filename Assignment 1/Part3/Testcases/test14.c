@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <pthread.h>
+#include "../mylib.h"
+
+#define NTHREADS 200
+#define NALLOC 500
+
+//per-CPU mode: many threads share the CPU heaps, and an idle thread holds no cached memory
+pthread_barrier_t idle, done;
+
+void *worker(void *arg)
+{
+	long id = (long)arg;
+	char *ptrs[NALLOC];
+	void *ret = NULL;
+
+	for(int i = 0; i < NALLOC; i++)
+	{
+		ptrs[i] = (char *)memalloc(8 + (i % 32) * 8);
+		if(ptrs[i] == NULL)
+			return (void *)1;
+		ptrs[i][0] = (char)(id + i);
+	}
+	for(int i = 0; i < NALLOC; i++)
+	{
+		if(ptrs[i][0] != (char)(id + i))
+			ret = (void *)2;
+		memfree(ptrs[i]);
+	}
+
+	pthread_barrier_wait(&idle);
+	pthread_barrier_wait(&done);
+	return ret;
+}
+
+int main()
+{
+	pthread_t tid[NTHREADS];
+	void *ret = 0;
+	struct memstats st;
+
+	if(memopt(MEM_OPT_PERCPU, 0) != -1 || memopt(MEM_OPT_PERCPU, 1) != 0)
+	{
+		printf("1.Testcase failed\n");
+		return -1;
+	}
+	if(memopt(MEM_OPT_THREADS, 4) != -1)
+	{
+		printf("2.Testcase failed\n");
+		return -1;
+	}
+
+	pthread_barrier_init(&idle, NULL, NTHREADS + 1);
+	pthread_barrier_init(&done, NULL, NTHREADS + 1);
+	for(long i = 0; i < NTHREADS; i++)
+		pthread_create(&tid[i], NULL, worker, (void *)i);
+
+	//every thread is alive but has freed everything it allocated
+	pthread_barrier_wait(&idle);
+	if(memstats(&st) != 0 || st.in_use != 0)
+	{
+		printf("3.Testcase failed\n");
+		return -1;
+	}
+	pthread_barrier_wait(&done);
+
+	for(int i = 0; i < NTHREADS; i++)
+	{
+		pthread_join(tid[i], &ret);
+		if(ret != NULL)
+		{
+			printf("4.Testcase failed\n");
+			return -1;
+		}
+	}
+
+	printf("Testcase passed\n");
+	return 0;
+}
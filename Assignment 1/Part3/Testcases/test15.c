@@ -0,0 +1,81 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "../mylib.h"
+
+#define NALLOC 30
+#define SIZE 200000
+
+//populated and prefaulted regions: the first touch of fresh heap memory takes (almost) no page faults
+char *first[NALLOC], *second[NALLOC];
+
+long minor_faults(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_THREAD, &ru);
+	return ru.ru_minflt;
+}
+
+//allocate about 6 MB, then fill it; returns the page faults taken by the first touch, or -1
+long fill(char **ptrs)
+{
+	long before;
+
+	for(int i = 0; i < NALLOC; i++)
+	{
+		ptrs[i] = (char *)memalloc(SIZE);
+		if(ptrs[i] == NULL)
+			return -1;
+	}
+	before = minor_faults();
+	for(int i = 0; i < NALLOC; i++)
+		memset(ptrs[i], i, SIZE);
+	return minor_faults() - before;
+}
+
+int release(char **ptrs)
+{
+	for(int i = 0; i < NALLOC; i++)
+	{
+		if(ptrs[i][SIZE - 1] != (char)i || memfree(ptrs[i]) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+int main()
+{
+	long faults;
+
+	if(memopt(MEM_OPT_POPULATE, 1) != 0)
+	{
+		printf("1.Testcase failed\n");
+		return -1;
+	}
+	faults = fill(first);
+	if(faults < 0 || faults > 100)
+	{
+		printf("2.Testcase failed\n");
+		return -1;
+	}
+
+	//the first batch stays live, so these regions come from the background thread
+	memopt(MEM_OPT_POPULATE, 0);
+	if(memopt(MEM_OPT_PREFAULT, 4) != 0)
+	{
+		printf("3.Testcase failed\n");
+		return -1;
+	}
+	usleep(200000);
+	faults = fill(second);
+	if(faults < 0 || faults > 100 || release(first) != 0 || release(second) != 0)
+	{
+		printf("4.Testcase failed\n");
+		return -1;
+	}
+
+	printf("Testcase passed\n");
+	return 0;
+}
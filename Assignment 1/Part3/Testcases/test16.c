@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include "../mylib.h"
+
+#define NFREE 64
+
+//large requests take the tightest free chunk, not just the first one that fits
+char *guard[NFREE];
+
+int main()
+{
+	char *tight, *loose, *ptrs[NFREE], *p;
+
+	//a tight and a loose fit, kept apart by in-use guards so they stay separate
+	tight = (char *)memalloc(9000);
+	guard[0] = (char *)memalloc(8);
+	loose = (char *)memalloc(16000);
+	guard[1] = (char *)memalloc(8);
+	if(tight == NULL || loose == NULL)
+	{
+		printf("1.Testcase failed\n");
+		return -1;
+	}
+	memfree(tight);
+	memfree(loose);
+	p = (char *)memalloc(8500);
+	if(p != tight)
+	{
+		printf("2.Testcase failed\n");
+		return -1;
+	}
+	//everything merges back, so the next guards are carved in address order
+	memfree(p);
+	memfree(guard[0]);
+	memfree(guard[1]);
+
+	//many free chunks; one fits within a few bytes, the rest are too small or too loose
+	for(int i = 0; i < NFREE; i++)
+	{
+		ptrs[i] = (char *)memalloc(20000 + i * 1000);
+		guard[i] = (char *)memalloc(8);
+		if(ptrs[i] == NULL)
+		{
+			printf("3.Testcase failed\n");
+			return -1;
+		}
+	}
+	for(int i = NFREE - 1; i >= 0; i--)
+		memfree(ptrs[i]);
+	p = (char *)memalloc(40000);
+	if(p != ptrs[20])
+	{
+		printf("4.Testcase failed\n");
+		return -1;
+	}
+	memfree(p);
+
+	for(int i = 0; i < NFREE; i++)
+		memfree(guard[i]);
+	printf("Testcase passed\n");
+	return 0;
+}
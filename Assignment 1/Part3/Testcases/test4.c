@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../mylib.h"
+
+#define NTHREADS 8
+#define NALLOC 2000
+
+//thread-safe mode: concurrent allocations must not overlap and can be freed by any thread
+char *ptrs[NTHREADS][NALLOC];
+
+void *worker(void *arg)
+{
+	long id = (long)arg;
+
+	for(int round = 0; round < 20; round++)
+	{
+		for(int i = 0; i < NALLOC; i++)
+		{
+			ptrs[id][i] = (char *)memalloc(8 + (i % 64) * 8);
+			if(ptrs[id][i] == NULL)
+				return (void *)1;
+			for(int j = 0; j < 8; j++)
+				ptrs[id][i][j] = (char)id;
+		}
+		for(int i = 0; i < NALLOC; i++)
+		{
+			for(int j = 0; j < 8; j++)
+				if(ptrs[id][i][j] != (char)id)
+					return (void *)2;
+			if(memfree(ptrs[id][i]) != 0)
+				return (void *)3;
+		}
+	}
+	return NULL;
+}
+
+int main()
+{
+	pthread_t tid[NTHREADS];
+	void *ret = 0;
+	char *p = 0;
+
+	if(memopt(MEM_OPT_THREADS, 4) != 0)
+	{
+		printf("1.Testcase failed\n");
+		return -1;
+	}
+
+	for(long i = 0; i < NTHREADS; i++)
+		pthread_create(&tid[i], NULL, worker, (void *)i);
+
+	for(int i = 0; i < NTHREADS; i++)
+	{
+		pthread_join(tid[i], &ret);
+		if(ret != NULL)
+		{
+			printf("2.Testcase failed\n");
+			return -1;
+		}
+	}
+
+	//memory freed by exited threads must be reusable
+	p = (char *)memalloc(4096);
+	if(p == NULL || memfree(p) != 0)
+	{
+		printf("3.Testcase failed\n");
+		return -1;
+	}
+
+	printf("Testcase passed\n");
+	return 0;
+}
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <unistd.h>
+#include "../mylib.h"
+
+//memrealloc grows in place into a free neighbour, memcalloc zeroes, memalign aligns
+int main()
+{
+	char *p = 0;
+	char *q = 0;
+	char *r = 0;
+	unsigned long *z = 0;
+
+	p = (char *)memalloc(100);
+	q = (char *)memalloc(100);
+	if(p == NULL || q == NULL)
+	{
+		printf("1.Testcase failed\n");
+		return -1;
+	}
+
+	for(int i = 0; i < 100; i++)
+		p[i] = 'a';
+
+	memfree(q);
+
+	//the chunk after p is free, so p must grow in place
+	r = (char *)memrealloc(p, 180);
+	if(r != p)
+	{
+		printf("2.Testcase failed\n");
+		return -1;
+	}
+
+	for(int i = 0; i < 100; i++)
+	{
+		if(r[i] != 'a')
+		{
+			printf("3.Testcase failed\n");
+			return -1;
+		}
+	}
+
+	//growing past the threshold moves the data to its own mapping
+	r = (char *)memrealloc(r, 1024 * 1024);
+	if(r == NULL || r[99] != 'a')
+	{
+		printf("4.Testcase failed\n");
+		return -1;
+	}
+	r = (char *)memrealloc(r, 4 * 1024 * 1024);
+	if(r == NULL || r[0] != 'a')
+	{
+		printf("5.Testcase failed\n");
+		return -1;
+	}
+	memfree(r);
+
+	z = (unsigned long *)memcalloc(64, sizeof(unsigned long));
+	if(z == NULL)
+	{
+		printf("6.Testcase failed\n");
+		return -1;
+	}
+	for(int i = 0; i < 64; i++)
+	{
+		if(z[i] != 0)
+		{
+			printf("7.Testcase failed\n");
+			return -1;
+		}
+	}
+	memfree(z);
+
+	for(unsigned long align = 16; align <= 4096; align *= 2)
+	{
+		q = (char *)memalign(align, 40);
+		if(q == NULL || ((unsigned long)q & (align - 1)) != 0)
+		{
+			printf("8.Testcase failed\n");
+			return -1;
+		}
+		if(memfree(q) != 0)
+		{
+			printf("9.Testcase failed\n");
+			return -1;
+		}
+	}
+
+	printf("Testcase passed\n");
+	return 0;
+}
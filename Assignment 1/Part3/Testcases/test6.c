@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <unistd.h>
+#include "../mylib.h"
+
+//memstats reports regions, free chunks, bytes in use and the free chunk histogram
+int main()
+{
+	struct memstats before, after;
+	char *p[4];
+	char *big = 0;
+
+	p[0] = (char *)memalloc(100);
+	p[1] = (char *)memalloc(100);
+	p[2] = (char *)memalloc(100);
+	p[3] = (char *)memalloc(100);
+	big = (char *)memalloc(1024 * 1024);
+	if(p[0] == NULL || p[3] == NULL || big == NULL)
+	{
+		printf("1.Testcase failed\n");
+		return -1;
+	}
+
+	if(memstats(&before) != 0)
+	{
+		printf("2.Testcase failed\n");
+		return -1;
+	}
+
+	//one region holding the small chunks, one direct mapping for the big one
+	if(before.regions != 1 || before.direct != 1 || before.free_chunks != 1)
+	{
+		printf("3.Testcase failed\n");
+		return -1;
+	}
+	if(before.in_use < 4 * 112 + 1024 * 1024 || before.largest_free != before.free_bytes)
+	{
+		printf("4.Testcase failed\n");
+		return -1;
+	}
+
+	//freeing a chunk between two allocated ones adds a 112 byte free chunk
+	memfree(p[1]);
+	memfree(big);
+	memstats(&after);
+	if(after.free_chunks != 2 || after.free_hist[6] != before.free_hist[6] + 1)
+	{
+		printf("5.Testcase failed\n");
+		return -1;
+	}
+	if(after.direct != 0 || after.in_use != before.in_use - 112 - before.direct_bytes)
+	{
+		printf("6.Testcase failed\n");
+		return -1;
+	}
+
+	printf("Testcase passed\n");
+	return 0;
+}
@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <unistd.h>
+#include "../mylib.h"
+
+//arena objects are packed back to back without headers and reset rewinds to the start
+int main()
+{
+	struct memarena *a = 0;
+	char *first = 0;
+	char *p = 0;
+	char *q = 0;
+	char *big = 0;
+
+	a = memarena_create();
+	if(a == NULL)
+	{
+		printf("1.Testcase failed\n");
+		return -1;
+	}
+
+	first = (char *)memarena_alloc(a, 20);
+	p = (char *)memarena_alloc(a, 16);
+	if(first == NULL || p != first + 24)
+	{
+		printf("2.Testcase failed\n");
+		return -1;
+	}
+
+	//more than fits in one block
+	for(int i = 0; i < 100000; i++)
+	{
+		q = (char *)memarena_alloc(a, 100);
+		if(q == NULL)
+		{
+			printf("3.Testcase failed\n");
+			return -1;
+		}
+		q[0] = q[99] = 'x';
+	}
+
+	big = (char *)memarena_alloc(a, 16 * 1024 * 1024);
+	if(big == NULL)
+	{
+		printf("4.Testcase failed\n");
+		return -1;
+	}
+	big[16 * 1024 * 1024 - 1] = 'x';
+
+	memarena_reset(a);
+	p = (char *)memarena_alloc(a, 20);
+	if(p != first)
+	{
+		printf("5.Testcase failed\n");
+		return -1;
+	}
+
+	memarena_destroy(a);
+	printf("Testcase passed\n");
+	return 0;
+}
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <unistd.h>
+#include "../mylib.h"
+
+#define NOBJ 10000
+
+//pool objects are aligned, packed without headers and recycled in constant time
+char *objs[NOBJ];
+
+int main()
+{
+	struct mempool *pool = 0;
+	struct mempool *other = 0;
+	char *p = 0;
+	char *q = 0;
+
+	pool = mempool_create(48, 16);
+	other = mempool_create(96, 64);
+	if(pool == NULL || other == NULL)
+	{
+		printf("1.Testcase failed\n");
+		return -1;
+	}
+
+	p = (char *)mempool_get(pool);
+	q = (char *)mempool_get(pool);
+	if(p == NULL || q != p + 48 || ((unsigned long)p & 15) != 0)
+	{
+		printf("2.Testcase failed\n");
+		return -1;
+	}
+
+	//the freed object is handed out again
+	if(mempool_put(pool, p) != 0 || mempool_get(pool) != p)
+	{
+		printf("3.Testcase failed\n");
+		return -1;
+	}
+
+	//objects must not be returned to the wrong pool
+	if(mempool_put(other, q) != -1)
+	{
+		printf("4.Testcase failed\n");
+		return -1;
+	}
+
+	for(int i = 0; i < NOBJ; i++)
+	{
+		objs[i] = (char *)mempool_get(other);
+		if(objs[i] == NULL || ((unsigned long)objs[i] & 63) != 0)
+		{
+			printf("5.Testcase failed\n");
+			return -1;
+		}
+		objs[i][0] = objs[i][95] = (char)i;
+	}
+	for(int i = 0; i < NOBJ; i++)
+	{
+		if(objs[i][0] != (char)i || objs[i][95] != (char)i || mempool_put(other, objs[i]) != 0)
+		{
+			printf("6.Testcase failed\n");
+			return -1;
+		}
+	}
+
+	mempool_destroy(pool);
+	mempool_destroy(other);
+	printf("Testcase passed\n");
+	return 0;
+}
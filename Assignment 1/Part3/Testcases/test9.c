@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "../mylib.h"
+
+//small objects served header-less from single-size pages
+int main()
+{
+	char *p = 0;
+	char *q = 0;
+	char *r = 0;
+	char *big = 0;
+	unsigned long *z = 0;
+
+	if(memopt(MEM_OPT_SMALL_PAGES, 1) != 0)
+	{
+		printf("1.Testcase failed\n");
+		return -1;
+	}
+
+	//16 byte objects sit back to back without a header
+	p = (char *)memalloc(16);
+	q = (char *)memalloc(16);
+	if(p == NULL || q != p + 16 || memusable(p) != 16)
+	{
+		printf("2.Testcase failed\n");
+		return -1;
+	}
+
+	//objects of another size come from another page
+	r = (char *)memalloc(100);
+	if(r == NULL || ((unsigned long)r & ~4095UL) == ((unsigned long)p & ~4095UL))
+	{
+		printf("3.Testcase failed\n");
+		return -1;
+	}
+
+	if(memfree(p) != 0 || memalloc(16) != p)
+	{
+		printf("4.Testcase failed\n");
+		return -1;
+	}
+
+	//growing past the small limit moves the data to a chunk with a header
+	strcpy(q, "header-less");
+	q = (char *)memrealloc(q, 1000);
+	if(q == NULL || strcmp(q, "header-less") != 0 || memusable(q) < 1000)
+	{
+		printf("5.Testcase failed\n");
+		return -1;
+	}
+
+	z = (unsigned long *)memcalloc(8, sizeof(unsigned long));
+	if(z == NULL)
+	{
+		printf("6.Testcase failed\n");
+		return -1;
+	}
+	for(int i = 0; i < 8; i++)
+	{
+		if(z[i] != 0)
+		{
+			printf("7.Testcase failed\n");
+			return -1;
+		}
+	}
+
+	big = (char *)memalloc(4096);
+	if(big == NULL || memfree(big) != 0 || memfree(q) != 0 || memfree(r) != 0 || memfree(z) != 0)
+	{
+		printf("8.Testcase failed\n");
+		return -1;
+	}
+
+	printf("Testcase passed\n");
+	return 0;
+}
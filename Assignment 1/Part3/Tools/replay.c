@@ -0,0 +1,299 @@
+/*
+ * Replays an allocation trace against memalloc and reports how the heap
+ * behaved over time. Record a trace with the LD_PRELOAD shim:
+ *
+ *     MEMALLOC_TRACE=app.trace LD_PRELOAD=$PWD/libmylib.so ./app
+ *     ./Tools/replay [-t] [-s] [-r rows] app.trace
+ *
+ * -t replays in thread-safe mode (one heap), as the shim runs the library;
+ * -s turns on header-less small objects (MEM_OPT_SMALL_PAGES).
+ *
+ * Object ids are mapped to dense slots before the clock starts, so the timed
+ * pass only calls the allocator. The heap is sampled with memstats() 200
+ * times over the trace, outside the timed part; rows (20 by default) show:
+ *   time   milliseconds spent in allocator calls so far
+ *   live   bytes requested and not yet freed
+ *   foot   footprint: heap regions plus direct mappings
+ *   frag   foot / live
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "../mylib.h"
+#include "trace.h"
+
+#define SAMPLES 200
+
+struct op {
+    uint8_t kind;           // TRACE_* without the alignment bits
+    uint8_t align_log;
+    uint32_t slot;
+    uint64_t size;
+};
+
+/*
+ * Live ids to slots, open addressing with linear probing. Id 0 never occurs
+ * (ids are non-null addresses) and marks an empty entry.
+ */
+struct id_map {
+    uint64_t *keys;
+    uint32_t *slots;
+    unsigned long cap;
+    unsigned long count;
+};
+
+static unsigned long id_hash(struct id_map *m, uint64_t id) {
+    return ((id >> 4) * 0x9e3779b97f4a7c15UL >> 32) & (m->cap - 1);
+}
+
+static long map_find(struct id_map *m, uint64_t id) {
+    for (unsigned long i = id_hash(m, id); m->keys[i]; i = (i + 1) & (m->cap - 1)) {
+        if (m->keys[i] == id) return i;
+    }
+    return -1;
+}
+
+static void map_put(struct id_map *m, uint64_t id, uint32_t slot);
+
+static void map_grow(struct id_map *m) {
+    struct id_map old = *m;
+    m->cap = old.cap ? old.cap * 2 : 1024;
+    m->keys = calloc(m->cap, sizeof(uint64_t));
+    m->slots = malloc(m->cap * sizeof(uint32_t));
+    m->count = 0;
+    if (!m->keys || !m->slots) {
+        fprintf(stderr, "replay: out of memory\n");
+        exit(1);
+    }
+    for (unsigned long i = 0; i < old.cap; i++) {
+        if (old.keys[i]) map_put(m, old.keys[i], old.slots[i]);
+    }
+    free(old.keys);
+    free(old.slots);
+}
+
+static void map_put(struct id_map *m, uint64_t id, uint32_t slot) {
+    if (2 * (m->count + 1) > m->cap) map_grow(m);
+    unsigned long i = id_hash(m, id);
+    while (m->keys[i]) i = (i + 1) & (m->cap - 1);
+    m->keys[i] = id;
+    m->slots[i] = slot;
+    m->count++;
+}
+
+// Backward-shift deletion keeps every probe sequence unbroken
+static void map_remove(struct id_map *m, unsigned long i) {
+    unsigned long j = i;
+    for (;;) {
+        j = (j + 1) & (m->cap - 1);
+        if (!m->keys[j]) break;
+        unsigned long home = id_hash(m, m->keys[j]);
+        if (((j - home) & (m->cap - 1)) >= ((j - i) & (m->cap - 1))) {
+            m->keys[i] = m->keys[j];
+            m->slots[i] = m->slots[j];
+            i = j;
+        }
+    }
+    m->keys[i] = 0;
+    m->count--;
+}
+
+static struct op *ops;
+static unsigned long nops;
+static uint32_t nslots;
+
+// Slots of freed objects, reused first
+static uint32_t *free_slots;
+static unsigned long nfree_slots;
+
+static uint32_t slot_new(void) {
+    return nfree_slots ? free_slots[--nfree_slots] : nslots++;
+}
+
+static void emit(unsigned int kind, unsigned int align_log, uint32_t slot, uint64_t size) {
+    ops[nops++] = (struct op){ kind, align_log, slot, size };
+}
+
+/*
+ * Turn records into ops on dense slots. Frees and reallocs of ids the trace
+ * never saw allocated (made before recording started) are dropped, or
+ * replayed as fresh allocations in the realloc case.
+ */
+static void convert(struct trace_rec *recs, unsigned long n) {
+    struct id_map map = { 0 };
+    map_grow(&map);
+    ops = malloc(n * sizeof(struct op));
+    free_slots = malloc(n * sizeof(uint32_t));
+    if (!ops || !free_slots) {
+        fprintf(stderr, "replay: out of memory\n");
+        exit(1);
+    }
+
+    for (unsigned long r = 0; r < n; r++) {
+        unsigned int kind = TRACE_OP(recs[r].op);
+        long i = map_find(&map, recs[r].id);
+
+        switch (kind) {
+        case TRACE_MALLOC:
+        case TRACE_CALLOC:
+        case TRACE_MEMALIGN: {
+            if (i >= 0) map_remove(&map, i);    // a free we did not see
+            uint32_t slot = slot_new();
+            map_put(&map, recs[r].id, slot);
+            emit(kind, kind == TRACE_MEMALIGN ? recs[r].op >> 8 : 0, slot, recs[r].size);
+            break;
+        }
+
+        case TRACE_FREE:
+            if (i < 0) break;
+            free_slots[nfree_slots++] = map.slots[i];
+            emit(kind, 0, map.slots[i], 0);
+            map_remove(&map, i);
+            break;
+
+        case TRACE_REALLOC: {
+            if (r + 1 == n || TRACE_OP(recs[r + 1].op) != TRACE_MOVE) break;
+            uint64_t new_id = recs[r + 1].id;
+            uint32_t slot;
+            if (i >= 0) {
+                slot = map.slots[i];
+                map_remove(&map, i);
+                emit(kind, 0, slot, recs[r].size);
+            } else {
+                slot = slot_new();
+                emit(TRACE_MALLOC, 0, slot, recs[r].size);
+            }
+            i = map_find(&map, new_id);
+            if (i >= 0) map_remove(&map, i);
+            map_put(&map, new_id, slot);
+            r++;
+            break;
+        }
+        }
+    }
+    free(map.keys);
+    free(map.slots);
+}
+
+static inline unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static unsigned long footprint(void) {
+    struct memstats st;
+    memstats(&st);
+    return st.mapped + st.direct_bytes;
+}
+
+static double frag(unsigned long foot, unsigned long live) {
+    return live ? (double)foot / live : 0;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    int rows = 20;
+    while ((opt = getopt(argc, argv, "tsr:")) != -1) {
+        switch (opt) {
+        case 't': memopt(MEM_OPT_THREADS, 1); break;
+        case 's': memopt(MEM_OPT_SMALL_PAGES, 1); break;
+        case 'r': rows = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-t] [-s] [-r rows] trace\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind + 1 != argc || rows < 1 || rows > SAMPLES) {
+        fprintf(stderr, "usage: %s [-t] [-s] [-r rows] trace\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb) != 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    char *file = sb.st_size ? mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (file == MAP_FAILED || sb.st_size < 8 || memcmp(file, TRACE_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: not an allocation trace\n", argv[optind]);
+        return 1;
+    }
+    unsigned long nrecs = (sb.st_size - 8) / sizeof(struct trace_rec);
+    convert((struct trace_rec *)(file + 8), nrecs);
+    munmap(file, sb.st_size);
+    close(fd);
+
+    void **ptrs = calloc(nslots ? nslots : 1, sizeof(void *));
+    uint64_t *sizes = calloc(nslots ? nslots : 1, sizeof(uint64_t));
+    if (!ptrs || !sizes) {
+        fprintf(stderr, "replay: out of memory\n");
+        return 1;
+    }
+
+    printf("%lu records, %lu calls replayed, %u objects at most\n", nrecs, nops, nslots);
+    printf("%12s %10s %12s %12s %8s\n", "calls", "time(ms)", "live(KB)", "foot(KB)", "frag");
+
+    unsigned long elapsed = 0, live = 0, failed = 0;
+    unsigned long peak_foot = 0, peak_live = 0, live_at_peak = 0;
+    unsigned long i = 0;
+    for (int s = 1; s <= SAMPLES; s++) {
+        unsigned long end = nops * s / SAMPLES;
+        unsigned long start = now_ns();
+        for (; i < end; i++) {
+            struct op *o = &ops[i];
+            void *p;
+            switch (o->kind) {
+            case TRACE_MALLOC: p = memalloc(o->size); break;
+            case TRACE_CALLOC: p = memcalloc(1, o->size); break;
+            case TRACE_MEMALIGN: p = memalign(1UL << o->align_log, o->size); break;
+            case TRACE_REALLOC:
+                p = memrealloc(ptrs[o->slot], o->size);
+                if (!p) break;
+                live -= sizes[o->slot];
+                ptrs[o->slot] = NULL;
+                break;
+            default:
+                if (ptrs[o->slot]) {
+                    memfree(ptrs[o->slot]);
+                    live -= sizes[o->slot];
+                    ptrs[o->slot] = NULL;
+                }
+                continue;
+            }
+            if (!p) {
+                failed++;
+                continue;
+            }
+            ptrs[o->slot] = p;
+            sizes[o->slot] = o->size;
+            live += o->size;
+        }
+        elapsed += now_ns() - start;
+
+        unsigned long foot = footprint();
+        if (foot > peak_foot) {
+            peak_foot = foot;
+            live_at_peak = live;
+        }
+        if (live > peak_live) peak_live = live;
+        if (s % (SAMPLES / rows) == 0 || s == SAMPLES) {
+            printf("%12lu %10.1f %12lu %12lu %8.2f\n", end, elapsed / 1e6, live / 1024, foot / 1024, frag(foot, live));
+        }
+    }
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("total: %.1f ms, %.0f calls/s, %lu failed\n", elapsed / 1e6, elapsed ? nops * 1e9 / elapsed : 0.0, failed);
+    printf("peak: foot %lu KB (frag %.2f), live %lu KB, rss %ld KB\n",
+           peak_foot / 1024, frag(peak_foot, live_at_peak), peak_live / 1024, ru.ru_maxrss);
+    return 0;
+}
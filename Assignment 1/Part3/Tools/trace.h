@@ -0,0 +1,41 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Allocation trace format, written by libmylib.so when MEMALLOC_TRACE names
+ * a file and read by Tools/replay. The file is TRACE_MAGIC followed by
+ * fixed-size records in the order the calls completed.
+ *
+ * An object's id is its address when it was allocated; an id may come back
+ * once the object has been freed. Calls that fail are not recorded.
+ *
+ *   TRACE_MALLOC   size bytes allocated as id
+ *   TRACE_CALLOC   same, zeroed; size is nmemb * size
+ *   TRACE_MEMALIGN same, aligned to TRACE_ALIGN(op)
+ *   TRACE_FREE     id released; size is 0
+ *   TRACE_REALLOC  id resized to size bytes, always followed by
+ *   TRACE_MOVE     giving the id the object has from then on
+ */
+#define TRACE_MAGIC "MEMTRC01"
+
+#define TRACE_MALLOC 1
+#define TRACE_CALLOC 2
+#define TRACE_MEMALIGN 3
+#define TRACE_FREE 4
+#define TRACE_REALLOC 5
+#define TRACE_MOVE 6
+
+// The op field carries log2 of the alignment above the op itself
+#define TRACE_OP(op) ((op) & 0xff)
+#define TRACE_ALIGN(op) (1UL << ((op) >> 8))
+#define TRACE_MEMALIGN_OP(align) (TRACE_MEMALIGN | (uint64_t)__builtin_ctzl(align) << 8)
+
+struct trace_rec {
+    uint64_t op;
+    uint64_t size;
+    uint64_t id;
+};
+
+#endif
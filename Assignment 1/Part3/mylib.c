@@ -1,193 +1,1810 @@
+#define _GNU_SOURCE
 #include "mylib.h"
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <execinfo.h>
+#include <dlfcn.h>
+#include <fcntl.h>
 
-void *head = NULL;
+#define REGION_SIZE (4 * 1024 * 1024)
+#define MIN_CHUNK 24
+
+/*
+ * Free chunks are kept in size-class bins. Chunks up to SMALL_MAX bytes get
+ * one exact class per 8-byte step. Larger ones are binned two-level, as in
+ * TLSF: by power of two, then into SL_COUNT equal slices of that range.
+ * All bins are threaded through one doubly-linked list ordered by class:
+ * bins[k] is the first chunk of class k, and the chunk after the last member
+ * of a class is the first member of the next non-empty class.
+ *
+ * Chunk layout: [size][next][prev]...[size] while free, [size][payload]
+ * while in use. The trailing size (boundary tag) lets memfree find the
+ * physically preceding chunk; MIN_CHUNK chunks have no room for it, so the
+ * following header records that case instead. Each mapping ends with a
+ * zero-size fence header that is never free.
+ */
+#define SMALL_MAX 1024
+#define NSMALL ((SMALL_MAX - MIN_CHUNK) / 8 + 1)
+#define SL_BITS 3
+#define SL_COUNT (1 << SL_BITS)
+#define NBINS (NSMALL + (64 - 10) * SL_COUNT)
+#define BINMAP_WORDS ((NBINS + 63) / 64)
+
+#define PREV_FREE 0x1UL     // physically preceding chunk is free
+#define PREV_MIN  0x2UL     // ... and is a MIN_CHUNK chunk without a footer
+#define MMAPPED   0x4UL     // chunk has a mapping of its own
+#define FLAGS     0x7UL
+
+#define HDR(c) (*(unsigned long *)(c))
+#define SIZE(c) (HDR(c) & ~FLAGS)
+#define SET_SIZE(c, s) (HDR(c) = (s) | (HDR(c) & FLAGS))
+#define FOOTER(c) (*(unsigned long *)((c) + SIZE(c) - sizeof(unsigned long)))
+#define NEXT(c) (*(void **)((c) + sizeof(unsigned long)))
+#define PREV(c) (*(void **)((c) + 2 * sizeof(unsigned long)))
+
+/*
+ * Header-less small objects (MEM_OPT_SMALL_PAGES): requests up to
+ * SMALL_OBJ_MAX bytes are rounded to a multiple of 8 and served from pages
+ * that hold objects of a single size. Those pages come from dedicated small
+ * regions whose header carries one descriptor per page, so memfree finds an
+ * object's class through the region map and the page index alone.
+ */
+#define SMALL_OBJ_MAX 256
+#define NOBJ (SMALL_OBJ_MAX / 8)
+#define SMALL_PAGE 4096
+#define OBJ_SLOT(cls) (((cls) + 1) * 8)
+
+struct small_page {
+    void *free;                 // freed objects, linked through their first word
+    void *bump;                 // first object never handed out
+    struct small_page *next;    // partial or empty list
+    struct small_page *prev;
+    unsigned short used;
+    unsigned char cls;
+};
+
+/*
+ * A heap owns a set of regions and the bins for their free chunks. In the
+ * default single-threaded mode everything goes through heaps[0] without
+ * locking. Thread-safe mode (MEM_OPT_THREADS) spreads threads round-robin over
+ * several heaps, each with its own lock, and puts a per-thread cache of small
+ * chunks in front of them so the common path takes no lock and no atomic.
+ * Chunks a thread frees into another heap never take that heap's lock: the
+ * cache pushes them onto the owner's remote list, one compare-and-swap per
+ * run, and the next allocation that takes the owner's lock reclaims them.
+ *
+ * Per-CPU mode (MEM_OPT_PERCPU) has one heap per CPU instead and no thread
+ * caches: each call locks the heap of the CPU it runs on, so memory held
+ * back scales with the number of CPUs rather than threads.
+ */
+struct heap {
+    pthread_mutex_t lock;
+    void *remote;               // foreign frees, linked through the payload
+    void *head;
+    void *tail;
+    void *bins[NBINS];
+    unsigned long binmap[BINMAP_WORDS];
+    unsigned long mapped;       // bytes in regions
+    unsigned long idle;         // bytes in empty regions left resident
+    unsigned int nregions;
+    unsigned long nfree;        // chunks in the bins
+    unsigned long free_bytes;
+    unsigned long free_hist[MEMSTATS_BUCKETS];
+    struct small_page *small_partial[NOBJ];
+    struct small_page *small_empty;
+    struct small_region *small_carve;   // small region with unused pages
+    unsigned int small_next;            // first unused page in it
+    unsigned long small_regions;
+    unsigned long small_bytes;          // in objects handed out
+} __attribute__((aligned(64)));
+
+// Header at the base of every mapping; regions are REGION_SIZE aligned
+struct region {
+    struct heap *heap;
+    unsigned long size;
+    bool idle;                  // empty and counted in heap->idle
+    bool small;                 // holds header-less small objects
+};
+
+struct small_region {
+    struct region r;
+    struct small_page pages[REGION_SIZE / SMALL_PAGE];
+};
+
+#define SMALL_FIRST_PAGE ((sizeof(struct small_region) + SMALL_PAGE - 1) / SMALL_PAGE)
+
+#define MAX_HEAPS 64
+static struct heap heaps[MAX_HEAPS];
+static unsigned int nheaps = 1;
+static unsigned int next_heap;
+static bool threaded = false;
+static bool percpu = false;
+
+// Resident bytes of empty regions each heap may keep before releasing them
+static unsigned long retain_bytes = REGION_SIZE;
+
+/*
+ * Chunks above mmap_threshold bypass the heaps and get a mapping of their
+ * own: [lead][size | MMAPPED][payload], where lead is the distance from the
+ * start of the mapping to the header and size runs to the end of it.
+ */
+static unsigned long mmap_threshold = 256 * 1024;
+static unsigned long direct_count;
+static unsigned long direct_bytes;
+
+static bool small_pages = false;     // serve small requests header-less
+static bool small_seen = false;      // some small region exists
+
+/*
+ * Huge page backing (MEM_OPT_HUGEPAGES). Every mapping made by map_aligned is
+ * REGION_SIZE aligned and a multiple of it, so it is made of whole 2 MB
+ * pages: either transparent huge pages requested through madvise, or pages
+ * from the hugetlb pool, falling back to THP when the pool runs dry.
+ */
+#define HUGE_PAGE (2 * 1024 * 1024)
+static unsigned long huge_pages = MEM_HUGE_OFF;
+
+/*
+ * Prefaulting. MEM_OPT_POPULATE faults in every new mapping before it is
+ * used. MEM_OPT_PREFAULT keeps up to READY_MAX populated REGION_SIZE
+ * mappings ready, refilled by a background thread whenever a take leaves
+ * fewer than ready_target, so a heap that grows by a region on the hot path
+ * finds one whose pages are already present.
+ */
+#define READY_MAX 64
+
+static bool populate = false;
+static void *ready[READY_MAX];
+static unsigned int nready;
+static unsigned long ready_target;
+static bool prefaulter;                 // the thread is running
+static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Per-thread cache of small chunks, one LIFO list per exact class linked
+ * through the payload. Cached chunks still count as in use for their heap.
+ * Lists refill from and drain to the owning heaps TCACHE_BATCH at a time.
+ */
+#define TCACHE_MAX 32
+#define TCACHE_BATCH 16
+
+struct tcache {
+    struct heap *heap;
+    void *list[NSMALL];
+    unsigned int count[NSMALL];
+    void *obj[NOBJ];            // header-less objects, per class
+    unsigned int obj_count[NOBJ];
+};
+
+static __thread struct tcache tcache;
+static pthread_key_t tcache_key;
+
+/*
+ * Region map: one entry per REGION_SIZE slice of the 47-bit user address
+ * space, in a two-level radix tree whose leaves are mapped on demand.
+ */
+#define MAP_SHIFT 22
+#define MAP_LEAF_BITS 13
+#define MAP_ROOT_BITS (47 - MAP_SHIFT - MAP_LEAF_BITS)
+
+static struct region **regmap[1 << MAP_ROOT_BITS];
+static pthread_mutex_t regmap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline void heap_lock(struct heap *h) {
+    if (threaded) pthread_mutex_lock(&h->lock);
+}
+
+static inline void heap_unlock(struct heap *h) {
+    if (threaded) pthread_mutex_unlock(&h->lock);
+}
 
 unsigned long align_size(unsigned long size) {
     if (size % 8 != 0) {
         size = size + (8 - size % 8);
     }
-    if (size < 24) size = 24;
+    if (size < MIN_CHUNK) size = MIN_CHUNK;
     return size;
 }
 
-void *memalloc(unsigned long size) {
-    size = align_size(size + sizeof(unsigned long));
-    
-    void *prev = NULL;
-    void *next = NULL;
-
-    if (!head) {
-        unsigned long total_size = 0;
-		if (size%(4 * 1024 * 1024) == 0 ) {
-			total_size = size;
-		} else {
-			total_size = (size / (4 * 1024 * 1024) + 1) * (4 * 1024 * 1024);
-		} 
-        head = mmap(NULL, total_size, PROT_READ|PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        if (head == MAP_FAILED) {
-            return NULL;
+static unsigned long region_size(unsigned long size) {
+    if (size % REGION_SIZE == 0) return size;
+    return (size / REGION_SIZE + 1) * REGION_SIZE;
+}
+
+static unsigned int size_class(unsigned long size) {
+    if (size <= SMALL_MAX) return (size - MIN_CHUNK) >> 3;
+    unsigned int fl = 63 - __builtin_clzl(size);
+    unsigned int sl = (size >> (fl - SL_BITS)) & (SL_COUNT - 1);
+    return NSMALL + (fl - 10) * SL_COUNT + sl;
+}
+
+// First non-empty bin with index >= k, or -1
+static int next_nonempty(struct heap *h, unsigned int k) {
+    if (k >= NBINS) return -1;
+    unsigned int w = k / 64;
+    unsigned long bits = h->binmap[w] & (~0UL << (k % 64));
+    while (!bits) {
+        if (++w == BINMAP_WORDS) return -1;
+        bits = h->binmap[w];
+    }
+    return w * 64 + __builtin_ctzl(bits);
+}
+
+// Push at the head of its class, i.e. just before the first chunk of the
+// same or next larger non-empty class
+static void bin_insert(struct heap *h, void *chunk) {
+    unsigned int k = size_class(SIZE(chunk));
+    int j = h->bins[k] ? (int)k : next_nonempty(h, k + 1);
+    void *succ = j < 0 ? NULL : h->bins[j];
+    void *pred = succ ? PREV(succ) : h->tail;
+
+    NEXT(chunk) = succ;
+    PREV(chunk) = pred;
+    if (pred) NEXT(pred) = chunk; else h->head = chunk;
+    if (succ) PREV(succ) = chunk; else h->tail = chunk;
+
+    h->bins[k] = chunk;
+    h->binmap[k / 64] |= 1UL << (k % 64);
+
+    h->nfree++;
+    h->free_bytes += SIZE(chunk);
+    h->free_hist[63 - __builtin_clzl(SIZE(chunk))]++;
+}
+
+static void bin_remove(struct heap *h, void *chunk) {
+    unsigned int k = size_class(SIZE(chunk));
+    void *succ = NEXT(chunk);
+    void *pred = PREV(chunk);
+
+    if (pred) NEXT(pred) = succ; else h->head = succ;
+    if (succ) PREV(succ) = pred; else h->tail = pred;
+
+    if (h->bins[k] == chunk) {
+        if (succ && size_class(SIZE(succ)) == k) {
+            h->bins[k] = succ;
+        } else {
+            h->bins[k] = NULL;
+            h->binmap[k / 64] &= ~(1UL << (k % 64));
         }
-        *(unsigned long *)head = total_size;
-        *(void **)(head + sizeof(unsigned long)) = NULL;
-        *(void **)(head + 2 * sizeof(unsigned long)) = NULL;
-    }
-
-    void *current = head;
-    while (current) {
-        unsigned long available_size = *(unsigned long *)current;
-        next = *(void **)(current + sizeof(unsigned long));
-        
-        if (available_size >= size) {
-            unsigned long remaining = available_size - size;
-            void *next_chunk = current + size;
-			void * prev_of_curr = *((void**)(current + 2*sizeof(unsigned long)));
-			if(prev_of_curr!=NULL)
-			{
-				*((void**)(prev_of_curr + sizeof(unsigned long))) = *((void**)(current + sizeof(unsigned long)));
-			}
-
-			void* next_of_curr = *((void**)(current + sizeof(unsigned long)));
-			if(next_of_curr!=NULL)
-			{
-				*((void**)(next_of_curr + 2*sizeof(unsigned long))) = *((void**)(current + 2*sizeof(unsigned long)));
-			}
-			if(current == head)
-			{
-				head = next_of_curr;
-			}				
-            if (remaining >= 24) {
-            	*(unsigned long *)current = size;
-                *(unsigned long *)next_chunk = remaining;
-                *(void **)(next_chunk + sizeof(unsigned long)) = head;
-                *(void **)(next_chunk + 2 * sizeof(unsigned long)) = NULL;
-
-				if(head != NULL)
-				*(void **)(head + 2*sizeof(unsigned long)) = next_chunk;
-
-				head = next_chunk;
+    }
+
+    h->nfree--;
+    h->free_bytes -= SIZE(chunk);
+    h->free_hist[63 - __builtin_clzl(SIZE(chunk))]--;
+}
+
+/*
+ * The following chunk may be in use by another thread, which reads its size
+ * without the heap lock, so its flag bits are updated with relaxed atomics.
+ * Only the holder of the heap lock ever writes them.
+ */
+static inline void set_next_flags(void *next, unsigned long clear, unsigned long set) {
+    unsigned long hdr = __atomic_load_n((unsigned long *)next, __ATOMIC_RELAXED);
+    __atomic_store_n((unsigned long *)next, (hdr & ~clear) | set, __ATOMIC_RELAXED);
+}
+
+// Tag the chunk as free in its footer and in the following header
+static void mark_free(void *chunk) {
+    unsigned long size = SIZE(chunk);
+    void *next = chunk + size;
+
+    if (size == MIN_CHUNK) {
+        set_next_flags(next, 0, PREV_FREE | PREV_MIN);
+    } else {
+        FOOTER(chunk) = size;
+        set_next_flags(next, PREV_MIN, PREV_FREE);
+    }
+}
+
+// Header of an in-use chunk read without the heap lock; see set_next_flags
+static inline unsigned long used_header(void *chunk) {
+    return __atomic_load_n((unsigned long *)chunk, __ATOMIC_RELAXED);
+}
+
+static void mark_used(void *chunk) {
+    set_next_flags(chunk + SIZE(chunk), PREV_FREE | PREV_MIN, 0);
+}
+
+static bool is_free(void *chunk) {
+    return SIZE(chunk) != 0 && (HDR(chunk + SIZE(chunk)) & PREV_FREE);
+}
+
+// Chunks of a large request's own class looked at before moving up
+#define FIT_PROBES 8
+
+/*
+ * Small classes are exact, so their head always fits. A large request's own
+ * class is probed for its best fit, at most FIT_PROBES chunks deep; failing
+ * that, the head of the next non-empty class fits and wastes at most one
+ * class width. Either way the search is bounded, however many chunks are free.
+ */
+static void *find_fit(struct heap *h, unsigned long size) {
+    unsigned int k = size_class(size);
+    void *best = NULL;
+    int probes = FIT_PROBES;
+
+    for (void *c = h->bins[k]; c && size_class(SIZE(c)) == k && probes--; c = NEXT(c)) {
+        if (SIZE(c) == size) return c;
+        if (SIZE(c) > size && (!best || SIZE(c) < SIZE(best))) best = c;
+    }
+    if (best) return best;
+
+    int j = next_nonempty(h, k + 1);
+    return j < 0 ? NULL : h->bins[j];
+}
+
+static int regmap_set(void *base, unsigned long size, struct region *r) {
+    int ret = 0;
+
+    if (threaded) pthread_mutex_lock(&regmap_lock);
+    for (unsigned long a = (unsigned long)base; a < (unsigned long)base + size; a += REGION_SIZE) {
+        unsigned long i = a >> MAP_SHIFT;
+        struct region **leaf = regmap[i >> MAP_LEAF_BITS];
+        if (!leaf) {
+            leaf = mmap(NULL, sizeof(struct region *) << MAP_LEAF_BITS, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (leaf == MAP_FAILED) {
+                ret = -1;
+                break;
             }
-			
-            return current + sizeof(unsigned long);
-        }
-		
-		else{
-			current = *(void**)(current + sizeof(unsigned long));
-		}
-	}
-	
-
-
-	if(current==NULL)
-	{ 
-		unsigned long total_size = 0;
-		if ((size%(4 * 1024 * 1024)) == 0 ) {
-			total_size = size;
-		} else {
-			total_size = (size / (4 * 1024 * 1024) + 1) * (4 * 1024 * 1024);
-		} 
-		void *new_block = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-		if (new_block == MAP_FAILED) {
-			return NULL;
-		}
-		*(unsigned long *)new_block = total_size;
-		unsigned long available_size = total_size;
-            unsigned long remaining = available_size - size;			
-            if (remaining >= 24) {
-				*(unsigned long*)(new_block) = size;
-				void* next_chunk = new_block + size;
-                *(unsigned long *)next_chunk = remaining;
-                *(void **)(next_chunk + sizeof(unsigned long)) = head;
-                *(void **)(next_chunk + 2 * sizeof(unsigned long)) = NULL;
-				*(void **)(head + 2*sizeof(unsigned long)) = next_chunk;
-				head = next_chunk;
-
-			}
-				return new_block + sizeof(unsigned long);
-
-
-	}
+            __atomic_store_n(&regmap[i >> MAP_LEAF_BITS], leaf, __ATOMIC_RELEASE);
+        }
+        leaf[i & ((1UL << MAP_LEAF_BITS) - 1)] = r;
+    }
+    if (threaded) pthread_mutex_unlock(&regmap_lock);
+    return ret;
+}
+
+static struct region *region_of(void *ptr) {
+    unsigned long i = (unsigned long)ptr >> MAP_SHIFT;
+    struct region **leaf = __atomic_load_n(&regmap[i >> MAP_LEAF_BITS], __ATOMIC_ACQUIRE);
+    return leaf ? leaf[i & ((1UL << MAP_LEAF_BITS) - 1)] : NULL;
+}
+
+// Fault in every page now, with one call where the kernel supports it
+static void prefault(void *p, unsigned long size) {
+    if (madvise(p, size, MADV_POPULATE_WRITE) == 0) return;
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    for (unsigned long off = 0; off < size; off += page) {
+        *(volatile char *)(p + off) = 0;
+    }
+}
+
+// mmap with the start rounded to REGION_SIZE by trimming the slack
+static void *map_fresh(unsigned long size, bool populated) {
+    void *p = MAP_FAILED;
+    if (huge_pages == MEM_HUGE_TLB) {
+        p = mmap(NULL, size + REGION_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    bool hugetlb = p != MAP_FAILED;
+    if (!hugetlb) {
+        p = mmap(NULL, size + REGION_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    // Hugetlb mappings are 2 MB aligned, so lead and the trim stay whole pages
+    unsigned long lead = -(unsigned long)p & (REGION_SIZE - 1);
+    if (lead) munmap(p, lead);
+    munmap(p + lead + size, REGION_SIZE - lead);
+    if (huge_pages != MEM_HUGE_OFF && !hugetlb) {
+        madvise(p + lead, size, MADV_HUGEPAGE);
+    }
+    if (populated) prefault(p + lead, size);
+    return p + lead;
+}
+
+static void *prefault_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&ready_lock);
+    for (;;) {
+        while (nready >= ready_target) pthread_cond_wait(&ready_cond, &ready_lock);
+        pthread_mutex_unlock(&ready_lock);
+
+        void *p = map_fresh(REGION_SIZE, true);
+
+        pthread_mutex_lock(&ready_lock);
+        if (!p) {
+            ready_target = nready;      // out of memory: stop until asked again
+        } else if (nready < READY_MAX) {
+            ready[nready] = p;
+            __atomic_store_n(&nready, nready + 1, __ATOMIC_RELAXED);
+        } else {
+            munmap(p, REGION_SIZE);
+        }
+    }
     return NULL;
 }
 
+static void *map_aligned(unsigned long size) {
+    if (size == REGION_SIZE && __atomic_load_n(&nready, __ATOMIC_RELAXED)) {
+        void *p = NULL;
+        pthread_mutex_lock(&ready_lock);
+        if (nready) {
+            __atomic_store_n(&nready, nready - 1, __ATOMIC_RELAXED);
+            p = ready[nready];
+            if (nready < ready_target) pthread_cond_signal(&ready_cond);
+        }
+        pthread_mutex_unlock(&ready_lock);
+        if (p) return p;
+    }
+    return map_fresh(size, populate);
+}
+
+// Map a new region big enough for a chunk of size bytes and return its
+// single free chunk, not yet binned
+static void *heap_grow(struct heap *h, unsigned long size) {
+    unsigned long total_size = region_size(size + sizeof(struct region) + sizeof(unsigned long));
+    struct region *r = map_aligned(total_size);
+    if (!r) {
+        return NULL;
+    }
+    if (regmap_set(r, total_size, r) != 0) {
+        munmap(r, total_size);
+        return NULL;
+    }
+    r->heap = h;
+    r->size = total_size;
+    r->idle = false;
+    r->small = false;
+    h->mapped += total_size;
+    h->nregions++;
+
+    void *chunk = (void *)r + sizeof(struct region);
+    HDR(chunk) = total_size - sizeof(struct region) - sizeof(unsigned long);
+    HDR(chunk + SIZE(chunk)) = 0;
+    return chunk;
+}
+
+// The region whose whole usable space is this one free chunk, if any
+static struct region *whole_region(void *chunk) {
+    if (((unsigned long)chunk & (REGION_SIZE - 1)) != sizeof(struct region)) return NULL;
+    if (SIZE(chunk + SIZE(chunk)) != 0) return NULL;
+
+    struct region *r = region_of(chunk);
+    return (void *)r + sizeof(struct region) == chunk ? r : NULL;
+}
+
+/*
+ * Called when a region becomes entirely free. Up to retain_bytes of such
+ * regions stay resident so a heap hovering around empty does not thrash.
+ * Beyond that the region is unmapped, or, if it is the heap's last one,
+ * kept mapped with its pages handed back through MADV_DONTNEED. Returns
+ * true if the region is gone.
+ */
+static bool region_release(struct heap *h, struct region *r, void *chunk) {
+    if (h->idle + r->size <= retain_bytes) {
+        h->idle += r->size;
+        r->idle = true;
+        return false;
+    }
+
+    if (h->nregions > 1) {
+        regmap_set(r, r->size, NULL);
+        h->mapped -= r->size;
+        h->nregions--;
+        munmap(r, r->size);
+        return true;
+    }
+
+    // Keep the chunk's header, links and footer; drop the pages in between.
+    // Huge pages are dropped whole, never split.
+    unsigned long page = huge_pages != MEM_HUGE_OFF ? HUGE_PAGE : sysconf(_SC_PAGESIZE);
+    unsigned long start = ((unsigned long)chunk + 3 * sizeof(unsigned long) + page - 1) & ~(page - 1);
+    unsigned long end = ((unsigned long)chunk + SIZE(chunk) - sizeof(unsigned long)) & ~(page - 1);
+    if (start < end) madvise((void *)start, end - start, MADV_DONTNEED);
+    return false;
+}
+
+static void *heap_alloc(struct heap *h, unsigned long size) {
+    void *current = find_fit(h, size);
+    if (current) {
+        struct region *r = whole_region(current);
+        if (r && r->idle) {
+            h->idle -= r->size;
+            r->idle = false;
+        }
+        bin_remove(h, current);
+    } else {
+        current = heap_grow(h, size);
+        if (!current) {
+            return NULL;
+        }
+    }
+
+    unsigned long remaining = SIZE(current) - size;
+    if (remaining >= MIN_CHUNK) {
+        void *next_chunk = current + size;
+        SET_SIZE(current, size);
+        HDR(next_chunk) = remaining;
+        mark_free(next_chunk);
+        bin_insert(h, next_chunk);
+    } else {
+        mark_used(current);
+    }
+
+    return current;
+}
+
+static void heap_free(struct heap *h, void *ptr) {
+    unsigned long size = SIZE(ptr);
+    void *next_chunk = ptr + size;
+
+    // Merge with the physically following chunk
+    if (is_free(next_chunk)) {
+        bin_remove(h, next_chunk);
+        size += SIZE(next_chunk);
+    }
+
+    // Merge with the physically preceding chunk
+    if (HDR(ptr) & PREV_FREE) {
+        void *prev_chunk = ptr - ((HDR(ptr) & PREV_MIN) ? MIN_CHUNK : *(unsigned long *)(ptr - sizeof(unsigned long)));
+        bin_remove(h, prev_chunk);
+        size += SIZE(prev_chunk);
+        ptr = prev_chunk;
+    }
+
+    SET_SIZE(ptr, size);
+    mark_free(ptr);
+
+    struct region *r = whole_region(ptr);
+    if (r && region_release(h, r, ptr)) return;
+    bin_insert(h, ptr);
+}
+
+/*
+ * Lock-free push of the list first..last onto h's remote list. Entries are
+ * payloads or header-less objects linked through their first word.
+ */
+static void remote_push(struct heap *h, void *first, void *last) {
+    void *head = __atomic_load_n(&h->remote, __ATOMIC_RELAXED);
+    do {
+        *(void **)last = head;
+    } while (!__atomic_compare_exchange_n(&h->remote, &head, first, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Foreign entries collected by a drain, pushed once per run of one heap
+struct remote_run {
+    struct heap *heap;
+    void *first;
+    void *last;
+};
+
+static void remote_add(struct remote_run *run, struct heap *h, void *ptr) {
+    if (h != run->heap) {
+        if (run->heap) remote_push(run->heap, run->first, run->last);
+        run->heap = h;
+        run->first = NULL;
+        run->last = ptr;
+    }
+    *(void **)ptr = run->first;
+    run->first = ptr;
+}
+
+static void remote_flush(struct remote_run *run) {
+    if (run->heap) remote_push(run->heap, run->first, run->last);
+}
+
+static void small_free(struct heap *h, struct region *r, void *obj);
+
+// Take the whole remote list at once and free it; h is locked
+static void remote_reclaim(struct heap *h) {
+    if (!__atomic_load_n(&h->remote, __ATOMIC_RELAXED)) return;
+
+    void *ptr = __atomic_exchange_n(&h->remote, NULL, __ATOMIC_ACQUIRE);
+    while (ptr) {
+        void *next = *(void **)ptr;
+        struct region *r = region_of(ptr);
+        if (r->small) small_free(h, r, ptr);
+        else heap_free(h, ptr - sizeof(unsigned long));
+        ptr = next;
+    }
+}
+
+// Return n chunks of class k: this thread's heap under one lock, others remotely
+static void tcache_drain(struct tcache *tc, unsigned int k, unsigned int n) {
+    struct remote_run run = { NULL, NULL, NULL };
+    bool locked = false;
+
+    while (n-- && tc->list[k]) {
+        void *chunk = tc->list[k];
+        tc->list[k] = NEXT(chunk);
+        tc->count[k]--;
+
+        struct heap *h = region_of(chunk)->heap;
+        if (h != tc->heap) {
+            remote_add(&run, h, chunk + sizeof(unsigned long));
+            continue;
+        }
+        if (!locked) {
+            heap_lock(h);
+            locked = true;
+        }
+        heap_free(h, chunk);
+    }
+    if (locked) heap_unlock(tc->heap);
+    remote_flush(&run);
+}
+
+static void tcache_refill(struct tcache *tc, unsigned int k, unsigned long size) {
+    heap_lock(tc->heap);
+    remote_reclaim(tc->heap);
+    for (int i = 0; i < TCACHE_BATCH; i++) {
+        void *chunk = heap_alloc(tc->heap, size);
+        if (!chunk) break;
+        NEXT(chunk) = tc->list[k];
+        tc->list[k] = chunk;
+        tc->count[k]++;
+    }
+    heap_unlock(tc->heap);
+}
+
+static struct region *small_region_of(void *ptr) {
+    if (!__atomic_load_n(&small_seen, __ATOMIC_RELAXED)) return NULL;
+    struct region *r = region_of(ptr);
+    return r && r->small ? r : NULL;
+}
+
+static struct small_page *small_page_of(struct region *r, void *ptr) {
+    return &((struct small_region *)r)->pages[(ptr - (void *)r) / SMALL_PAGE];
+}
+
+static void *small_page_addr(struct small_page *pg) {
+    struct small_region *sr = (void *)((unsigned long)pg & ~(unsigned long)(REGION_SIZE - 1));
+    return (void *)sr + (pg - sr->pages) * SMALL_PAGE;
+}
+
+static void page_list_push(struct small_page **list, struct small_page *pg) {
+    pg->prev = NULL;
+    pg->next = *list;
+    if (*list) (*list)->prev = pg;
+    *list = pg;
+}
+
+static void page_list_remove(struct small_page **list, struct small_page *pg) {
+    if (pg->prev) pg->prev->next = pg->next; else *list = pg->next;
+    if (pg->next) pg->next->prev = pg->prev;
+}
+
+// A page for class cls: an empty one of any class, else the next unused one
+static struct small_page *small_page_new(struct heap *h, unsigned int cls) {
+    struct small_page *pg = h->small_empty;
+    if (pg) {
+        page_list_remove(&h->small_empty, pg);
+    } else {
+        if (!h->small_carve || h->small_next == REGION_SIZE / SMALL_PAGE) {
+            struct small_region *sr = map_aligned(REGION_SIZE);
+            if (!sr) return NULL;
+            if (regmap_set(sr, REGION_SIZE, &sr->r) != 0) {
+                munmap(sr, REGION_SIZE);
+                return NULL;
+            }
+            sr->r.heap = h;
+            sr->r.size = REGION_SIZE;
+            sr->r.small = true;
+            h->small_carve = sr;
+            h->small_next = SMALL_FIRST_PAGE;
+            h->small_regions++;
+            __atomic_store_n(&small_seen, true, __ATOMIC_RELAXED);
+        }
+        pg = &h->small_carve->pages[h->small_next++];
+    }
+
+    pg->cls = cls;
+    pg->used = 0;
+    pg->free = NULL;
+    pg->bump = small_page_addr(pg);
+    return pg;
+}
+
+static void *small_alloc(struct heap *h, unsigned int cls) {
+    struct small_page *pg = h->small_partial[cls];
+    if (!pg) {
+        pg = small_page_new(h, cls);
+        if (!pg) return NULL;
+        page_list_push(&h->small_partial[cls], pg);
+    }
+
+    void *obj = pg->free;
+    if (obj) {
+        pg->free = *(void **)obj;
+    } else {
+        obj = pg->bump;
+        pg->bump += OBJ_SLOT(cls);
+    }
+
+    if (++pg->used == SMALL_PAGE / OBJ_SLOT(cls)) {
+        page_list_remove(&h->small_partial[cls], pg);
+    }
+    h->small_bytes += OBJ_SLOT(cls);
+    return obj;
+}
+
+static void small_free(struct heap *h, struct region *r, void *obj) {
+    struct small_page *pg = small_page_of(r, obj);
+    unsigned int cls = pg->cls;
+
+    *(void **)obj = pg->free;
+    pg->free = obj;
+    h->small_bytes -= OBJ_SLOT(cls);
+
+    if (pg->used-- == SMALL_PAGE / OBJ_SLOT(cls)) {
+        page_list_push(&h->small_partial[cls], pg);
+    }
+    if (pg->used == 0) {
+        page_list_remove(&h->small_partial[cls], pg);
+        page_list_push(&h->small_empty, pg);
+    }
+}
+
+// Same batching as the chunk cache, for header-less objects
+static void obj_drain(struct tcache *tc, unsigned int cls, unsigned int n) {
+    struct remote_run run = { NULL, NULL, NULL };
+    bool locked = false;
+
+    while (n-- && tc->obj[cls]) {
+        void *obj = tc->obj[cls];
+        tc->obj[cls] = *(void **)obj;
+        tc->obj_count[cls]--;
+
+        struct region *r = region_of(obj);
+        if (r->heap != tc->heap) {
+            remote_add(&run, r->heap, obj);
+            continue;
+        }
+        if (!locked) {
+            heap_lock(r->heap);
+            locked = true;
+        }
+        small_free(r->heap, r, obj);
+    }
+    if (locked) heap_unlock(tc->heap);
+    remote_flush(&run);
+}
+
+static void obj_refill(struct tcache *tc, unsigned int cls) {
+    heap_lock(tc->heap);
+    remote_reclaim(tc->heap);
+    for (int i = 0; i < TCACHE_BATCH; i++) {
+        void *obj = small_alloc(tc->heap, cls);
+        if (!obj) break;
+        *(void **)obj = tc->obj[cls];
+        tc->obj[cls] = obj;
+        tc->obj_count[cls]++;
+    }
+    heap_unlock(tc->heap);
+}
+
+// Thread exit: hand every cached chunk back
+static void tcache_release(void *arg) {
+    struct tcache *tc = arg;
+    for (unsigned int k = 0; k < NSMALL; k++) {
+        tcache_drain(tc, k, tc->count[k]);
+    }
+    for (unsigned int cls = 0; cls < NOBJ; cls++) {
+        obj_drain(tc, cls, tc->obj_count[cls]);
+    }
+    heap_lock(tc->heap);
+    remote_reclaim(tc->heap);
+    heap_unlock(tc->heap);
+    tc->heap = NULL;
+}
+
+static struct tcache *thread_cache(void) {
+    struct tcache *tc = &tcache;
+    if (!tc->heap) {
+        tc->heap = &heaps[__atomic_fetch_add(&next_heap, 1, __ATOMIC_RELAXED) % nheaps];
+        pthread_setspecific(tcache_key, tc);
+    }
+    return tc;
+}
+
+// sched_getcpu() reads the CPU from the thread's rseq area where glibc has one
+static struct heap *cpu_heap(void) {
+    int cpu = sched_getcpu();
+    return &heaps[(cpu < 0 ? 0 : cpu) % nheaps];
+}
+
+static struct heap *current_heap(void) {
+    if (!threaded) return &heaps[0];
+    return percpu ? cpu_heap() : thread_cache()->heap;
+}
+
+// The payload is aligned to alignment (a power of two, at least 8)
+static void *direct_alloc(unsigned long size, unsigned long alignment) {
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    unsigned long total_size = (size + alignment + sizeof(unsigned long) + page - 1) & ~(page - 1);
+
+    void *base = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    unsigned long payload = ((unsigned long)base + 2 * sizeof(unsigned long) + alignment - 1) & ~(alignment - 1);
+    void *chunk = (void *)payload - sizeof(unsigned long);
+    *(unsigned long *)(chunk - sizeof(unsigned long)) = chunk - base;
+    HDR(chunk) = (base + total_size - chunk) | MMAPPED;
+
+    __atomic_fetch_add(&direct_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&direct_bytes, total_size, __ATOMIC_RELAXED);
+    return chunk;
+}
+
+static int direct_free(void *chunk) {
+    unsigned long lead = *(unsigned long *)(chunk - sizeof(unsigned long));
+
+    __atomic_fetch_sub(&direct_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&direct_bytes, SIZE(chunk) + lead, __ATOMIC_RELAXED);
+    return munmap(chunk - lead, SIZE(chunk) + lead);
+}
+
+static void *small_obj_alloc(unsigned long size) {
+    unsigned int cls = size ? (size - 1) / 8 : 0;
+
+    if (!threaded) {
+        return small_alloc(&heaps[0], cls);
+    }
+
+    if (percpu) {
+        struct heap *h = cpu_heap();
+        heap_lock(h);
+        remote_reclaim(h);
+        void *obj = small_alloc(h, cls);
+        heap_unlock(h);
+        return obj;
+    }
+
+    struct tcache *tc = thread_cache();
+    if (!tc->obj[cls]) obj_refill(tc, cls);
+    void *obj = tc->obj[cls];
+    if (obj) {
+        tc->obj[cls] = *(void **)obj;
+        tc->obj_count[cls]--;
+    }
+    return obj;
+}
+
+static void small_obj_free(struct region *r, void *obj) {
+    if (!threaded) {
+        small_free(r->heap, r, obj);
+        return;
+    }
+
+    if (percpu) {
+        if (r->heap != cpu_heap()) {
+            remote_push(r->heap, obj, obj);
+            return;
+        }
+        heap_lock(r->heap);
+        small_free(r->heap, r, obj);
+        heap_unlock(r->heap);
+        return;
+    }
+
+    struct tcache *tc = thread_cache();
+    unsigned int cls = small_page_of(r, obj)->cls;
+    *(void **)obj = tc->obj[cls];
+    tc->obj[cls] = obj;
+    if (++tc->obj_count[cls] > TCACHE_MAX) obj_drain(tc, cls, TCACHE_BATCH);
+}
+
+/*
+ * Sampling heap profiler (MEM_OPT_PROFILE). Each thread counts down the bytes
+ * it allocates and records a backtrace when the count runs out, restarting it
+ * at a random value that averages profile_rate. A sample stands for
+ * profile_rate bytes, or its own size if that is larger. Live samples sit in a
+ * hash table keyed by address; memfree only looks there while some sample is
+ * live and the address's bucket is not empty.
+ */
+#define PROF_DEPTH 32
+#define PROF_SKIP 2                 // profile_alloc and the public entry point
+#define PROF_BITS 16
+
+struct prof_sample {
+    struct prof_sample *next;
+    void *ptr;
+    unsigned long size;
+    unsigned long weight;           // bytes the sample stands for
+    int depth;
+    void *stack[PROF_DEPTH];
+};
+
+static unsigned long profile_rate;          // 0 when off
+static unsigned long profile_live;          // samples in the table
+static struct prof_sample **prof_table;
+static struct mempool *prof_pool;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread long prof_left;
+static __thread unsigned long prof_seed;
+static __thread bool in_profiler;           // backtrace() may call back into us
+
+static unsigned int prof_bucket(void *ptr) {
+    return ((unsigned long)ptr >> 3) * 0x9e3779b97f4a7c15UL >> (64 - PROF_BITS);
+}
+
+// Uniform in [1, 2 * rate], from a per-thread xorshift generator
+static long prof_interval(unsigned long rate) {
+    if (!prof_seed) prof_seed = (unsigned long)&prof_seed | 1;
+    prof_seed ^= prof_seed << 13;
+    prof_seed ^= prof_seed >> 7;
+    prof_seed ^= prof_seed << 17;
+    return prof_seed % (2 * rate) + 1;
+}
+
+static __attribute__((noinline)) void profile_alloc(void *ptr, unsigned long size) {
+    unsigned long rate = profile_rate;
+    if ((prof_left -= size) > 0 || in_profiler || !rate) return;
+    in_profiler = true;
+    // Carry the overshoot so the samples stay one per rate bytes
+    prof_left += prof_interval(rate);
+    if (prof_left <= 0) prof_left = prof_interval(rate);
+
+    void *stack[PROF_DEPTH + PROF_SKIP];
+    int depth = backtrace(stack, PROF_DEPTH + PROF_SKIP) - PROF_SKIP;
+    if (depth < 0) depth = 0;
+
+    pthread_mutex_lock(&prof_lock);
+    struct prof_sample *smp = mempool_get(prof_pool);
+    if (smp) {
+        unsigned int b = prof_bucket(ptr);
+        smp->ptr = ptr;
+        smp->size = size ? size : 1;
+        smp->weight = size > rate ? size : rate;
+        smp->depth = depth;
+        memcpy(smp->stack, stack + PROF_SKIP, depth * sizeof(void *));
+        smp->next = prof_table[b];
+        __atomic_store_n(&prof_table[b], smp, __ATOMIC_RELEASE);
+        __atomic_store_n(&profile_live, profile_live + 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&prof_lock);
+    in_profiler = false;
+}
+
+static void profile_free(void *ptr) {
+    unsigned int b = prof_bucket(ptr);
+    if (in_profiler || !__atomic_load_n(&prof_table[b], __ATOMIC_ACQUIRE)) return;
+
+    pthread_mutex_lock(&prof_lock);
+    for (struct prof_sample **pp = &prof_table[b]; *pp; pp = &(*pp)->next) {
+        struct prof_sample *smp = *pp;
+        if (smp->ptr == ptr) {
+            __atomic_store_n(pp, smp->next, __ATOMIC_RELAXED);
+            mempool_put(prof_pool, smp);
+            __atomic_store_n(&profile_live, profile_live - 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&prof_lock);
+}
+
+// Only the sampling decision is paid on every allocation while profiling
+static inline __attribute__((always_inline)) void profile_hook(void *ptr, unsigned long size) {
+    if (__builtin_expect(profile_rate != 0, 0) && ptr) profile_alloc(ptr, size);
+}
+
+static int profile_start(unsigned long rate) {
+    if (rate && !prof_table) {
+        void *table = mmap(NULL, sizeof(void *) << PROF_BITS, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (table == MAP_FAILED) return -1;
+        prof_pool = mempool_create(sizeof(struct prof_sample), 0);
+        if (!prof_pool) {
+            munmap(table, sizeof(void *) << PROF_BITS);
+            return -1;
+        }
+        // The first backtrace() may load libgcc and allocate; get it over with
+        void *frame;
+        backtrace(&frame, 1);
+        prof_table = table;
+    }
+    profile_rate = rate;
+    return 0;
+}
+
+static void *do_memalloc(unsigned long size) {
+    if (small_pages && size <= SMALL_OBJ_MAX) {
+        return small_obj_alloc(size);
+    }
+
+    size = align_size(size + sizeof(unsigned long));
+
+    if (size > mmap_threshold) {
+        void *chunk = direct_alloc(size, sizeof(unsigned long));
+        return chunk ? chunk + sizeof(unsigned long) : NULL;
+    }
+
+    if (!threaded) {
+        void *chunk = heap_alloc(&heaps[0], size);
+        return chunk ? chunk + sizeof(unsigned long) : NULL;
+    }
+
+    void *chunk;
+    if (size <= SMALL_MAX && !percpu) {
+        struct tcache *tc = thread_cache();
+        unsigned int k = size_class(size);
+        if (!tc->list[k]) tcache_refill(tc, k, size);
+        chunk = tc->list[k];
+        if (chunk) {
+            tc->list[k] = NEXT(chunk);
+            tc->count[k]--;
+        }
+    } else {
+        struct heap *h = current_heap();
+        heap_lock(h);
+        remote_reclaim(h);
+        chunk = heap_alloc(h, size);
+        heap_unlock(h);
+    }
+    return chunk ? chunk + sizeof(unsigned long) : NULL;
+}
+
+void *memalloc(unsigned long size) {
+    void *ptr = do_memalloc(size);
+    profile_hook(ptr, size);
+    return ptr;
+}
+
 int memfree(void *ptr) {
     if (!ptr) return -1;
-    ptr = ptr - sizeof(unsigned long);  
+    if (__atomic_load_n(&profile_live, __ATOMIC_RELAXED)) profile_free(ptr);
+
+    struct region *r = small_region_of(ptr);
+    if (r) {
+        small_obj_free(r, ptr);
+        return 0;
+    }
+
+    ptr = ptr - sizeof(unsigned long);
+
+    unsigned long hdr = used_header(ptr);
+    if (hdr & MMAPPED) {
+        return direct_free(ptr);
+    }
+
+    if (!threaded) {
+        heap_free(&heaps[0], ptr);
+        return 0;
+    }
+
+    unsigned long size = hdr & ~FLAGS;
+    if (size <= SMALL_MAX && !percpu) {
+        struct tcache *tc = thread_cache();
+        unsigned int k = size_class(size);
+        NEXT(ptr) = tc->list[k];
+        tc->list[k] = ptr;
+        if (++tc->count[k] > TCACHE_MAX) tcache_drain(tc, k, TCACHE_BATCH);
+        return 0;
+    }
+
+    struct heap *h = region_of(ptr)->heap;
+    if (h != current_heap()) {
+        ptr += sizeof(unsigned long);
+        remote_push(h, ptr, ptr);
+        return 0;
+    }
+    heap_lock(h);
+    heap_free(h, ptr);
+    heap_unlock(h);
+    return 0;
+}
+
+static struct heap *heap_of(void *chunk) {
+    return threaded ? region_of(chunk)->heap : &heaps[0];
+}
+
+// Cut an in-use chunk down to size bytes and free the tail if it can stand alone
+static void split_tail(struct heap *h, void *chunk, unsigned long size) {
+    unsigned long remaining = SIZE(chunk) - size;
+    if (remaining < MIN_CHUNK) return;
 
-    unsigned long chunk_size = *(unsigned long *)ptr;
-    void *chunk_end = ptr + chunk_size;
+    void *rest = chunk + size;
+    SET_SIZE(chunk, size);
+    HDR(rest) = remaining;
+    heap_free(h, rest);
+}
+
+static void *direct_realloc(void *chunk, unsigned long size) {
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    unsigned long lead = *(unsigned long *)(chunk - sizeof(unsigned long));
+    unsigned long total_size = (lead + size + page - 1) & ~(page - 1);
+
+    unsigned long old_total = lead + SIZE(chunk);
+
+    void *base = mremap(chunk - lead, old_total, total_size, MREMAP_MAYMOVE);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    __atomic_fetch_add(&direct_bytes, total_size - old_total, __ATOMIC_RELAXED);
+    chunk = base + lead;
+    HDR(chunk) = (total_size - lead) | MMAPPED;
+    return chunk;
+}
+
+/*
+ * Resize in place where possible: direct chunks are remapped, heap chunks
+ * shrink by splitting off their tail or grow into a free physical successor.
+ * Only when neither works is the data copied to a new chunk.
+ */
+void *memrealloc(void *ptr, unsigned long size) {
+    if (!ptr) return memalloc(size);
+    if (size == 0) {
+        memfree(ptr);
+        return NULL;
+    }
 
-    void *prev_chunk = *((void**)(ptr + 2*sizeof(unsigned long)));
-    void *next_chunk = *((void**)(ptr + sizeof(unsigned long)));
+    struct region *r = small_region_of(ptr);
+    if (r) {
+        unsigned long slot = OBJ_SLOT(small_page_of(r, ptr)->cls);
+        if (size <= slot) return ptr;
 
-    unsigned long prev_size = prev_chunk ? *(unsigned long *)prev_chunk : 0;
-    void *prev_end = prev_chunk ? prev_chunk + prev_size : NULL;
-    unsigned long next_size = next_chunk ? *(unsigned long *)next_chunk : 0;
-    void *next_start = next_chunk;
+        void *new_ptr = memalloc(size);
+        if (!new_ptr) return NULL;
+        memcpy(new_ptr, ptr, slot);
+        memfree(ptr);
+        return new_ptr;
+    }
 
-    bool prev_free = prev_chunk && prev_end == ptr;
-    bool next_free = next_chunk && next_start == chunk_end;
+    void *chunk = ptr - sizeof(unsigned long);
+    unsigned long hdr = used_header(chunk);
+    unsigned long old_size = hdr & ~FLAGS;
+    size = align_size(size + sizeof(unsigned long));
 
-    // Case 1: Both contiguous chunks are allocated
-    if (!prev_free && !next_free) {
-        *(void **)(ptr + sizeof(unsigned long)) = head;
-        *(void **)(ptr + 2 * sizeof(unsigned long)) = NULL;
-        if (head) {
-            *(void **)(head + 2 * sizeof(unsigned long)) = ptr;
+    if (hdr & MMAPPED) {
+        chunk = direct_realloc(chunk, size);
+        return chunk ? chunk + sizeof(unsigned long) : NULL;
+    }
+
+    struct heap *h = heap_of(chunk);
+    bool done = false;
+
+    heap_lock(h);
+    if (size <= old_size) {
+        split_tail(h, chunk, size);
+        done = true;
+    } else {
+        void *next_chunk = chunk + old_size;
+        if (is_free(next_chunk) && old_size + SIZE(next_chunk) >= size) {
+            bin_remove(h, next_chunk);
+            SET_SIZE(chunk, old_size + SIZE(next_chunk));
+            mark_used(chunk);
+            split_tail(h, chunk, size);
+            done = true;
         }
-        head = ptr;
     }
-    
-    // Case 2: Only the contiguous chunk on the right is free
-    else if (!prev_free && next_free) {
-        unsigned long new_size = chunk_size + next_size;
-        *(unsigned long *)ptr = new_size;
-        void *next_next_chunk = *(void **)(next_chunk + sizeof(unsigned long));
+    heap_unlock(h);
+    if (done) return ptr;
 
-        *(void **)(ptr + sizeof(unsigned long)) = next_next_chunk;
-        if (next_next_chunk) {
-            *(void **)(next_next_chunk + 2 * sizeof(unsigned long)) = ptr;
+    void *new_ptr = memalloc(size - sizeof(unsigned long));
+    if (!new_ptr) return NULL;
+    memcpy(new_ptr, ptr, old_size - sizeof(unsigned long));
+    memfree(ptr);
+    return new_ptr;
+}
+
+// Direct chunks are fresh anonymous pages and already zero
+void *memcalloc(unsigned long nmemb, unsigned long size) {
+    unsigned long total;
+    if (__builtin_mul_overflow(nmemb, size, &total)) return NULL;
+
+    void *ptr = memalloc(total);
+    if (!ptr) return NULL;
+    if (small_region_of(ptr) || !(used_header(ptr - sizeof(unsigned long)) & MMAPPED)) {
+        memset(ptr, 0, total);
+    }
+    return ptr;
+}
+
+/*
+ * Over-allocate by alignment + MIN_CHUNK, then give back the part before the
+ * first aligned payload address that leaves room for a free chunk, and the
+ * unused tail.
+ */
+static void *do_memalign(unsigned long alignment, unsigned long size) {
+    if (alignment <= sizeof(unsigned long)) return do_memalloc(size);
+
+    size = align_size(size + sizeof(unsigned long));
+    if (size + alignment > mmap_threshold) {
+        void *chunk = direct_alloc(size, alignment);
+        return chunk ? chunk + sizeof(unsigned long) : NULL;
+    }
+
+    struct heap *h = current_heap();
+    heap_lock(h);
+    remote_reclaim(h);
+    void *chunk = heap_alloc(h, size + alignment + MIN_CHUNK);
+    if (chunk) {
+        unsigned long payload = (unsigned long)chunk + sizeof(unsigned long);
+        unsigned long aligned = (payload + alignment - 1) & ~(alignment - 1);
+        if (aligned != payload) {
+            if (aligned - payload < MIN_CHUNK) aligned += alignment;
+
+            void *lead = chunk;
+            unsigned long gap = aligned - payload;
+            chunk = lead + gap;
+            HDR(chunk) = SIZE(lead) - gap;
+            SET_SIZE(lead, gap);
+            heap_free(h, lead);
         }
-        
-        if (head == next_chunk) {
-            head = ptr;
+        split_tail(h, chunk, size);
+    }
+    heap_unlock(h);
+    return chunk ? chunk + sizeof(unsigned long) : NULL;
+}
+
+void *memalign(unsigned long alignment, unsigned long size) {
+    if (alignment & (alignment - 1)) return NULL;
+    void *ptr = do_memalign(alignment, size);
+    profile_hook(ptr, size);
+    return ptr;
+}
+
+#define BATCH_RUN_MAX (REGION_SIZE / 2)
+
+/*
+ * Allocate n objects of size bytes under a single lock. Header-less small
+ * objects come straight from their pages; heap chunks are cut from one
+ * contiguous run per BATCH_RUN_MAX bytes. Returns how many were allocated.
+ */
+static unsigned long do_memalloc_batch(unsigned long size, unsigned long n, void **ptrs) {
+    unsigned long done = 0;
+
+    if (small_pages && size <= SMALL_OBJ_MAX) {
+        struct heap *h = current_heap();
+        unsigned int cls = size ? (size - 1) / 8 : 0;
+        heap_lock(h);
+        remote_reclaim(h);
+        while (done < n && (ptrs[done] = small_alloc(h, cls))) done++;
+        heap_unlock(h);
+        return done;
+    }
+
+    unsigned long chunk_size = align_size(size + sizeof(unsigned long));
+    if (chunk_size > mmap_threshold || chunk_size > BATCH_RUN_MAX) {
+        while (done < n && (ptrs[done] = do_memalloc(size))) done++;
+        return done;
+    }
+
+    struct heap *h = current_heap();
+    heap_lock(h);
+    remote_reclaim(h);
+    while (done < n) {
+        unsigned long count = n - done;
+        if (count > BATCH_RUN_MAX / chunk_size) count = BATCH_RUN_MAX / chunk_size;
+
+        void *run = heap_alloc(h, count * chunk_size);
+        if (!run) break;
+
+        // The last chunk keeps whatever slack the run came with
+        unsigned long run_size = SIZE(run);
+        void *chunk = run;
+        for (unsigned long i = 0; i < count; i++) {
+            unsigned long this_size = i + 1 < count ? chunk_size : run_size - i * chunk_size;
+            if (i == 0) SET_SIZE(chunk, this_size); else HDR(chunk) = this_size;
+            ptrs[done++] = chunk + sizeof(unsigned long);
+            chunk += this_size;
         }
     }
+    heap_unlock(h);
+    return done;
+}
 
-    // Case 3: Only the contiguous chunk on the left is free
-    else if (prev_free && !next_free) {
-        unsigned long new_size = chunk_size + prev_size;
-        *(unsigned long *)prev_chunk = new_size;
+unsigned long memalloc_batch(unsigned long size, unsigned long n, void **ptrs) {
+    unsigned long done = do_memalloc_batch(size, n, ptrs);
+    for (unsigned long i = 0; profile_rate && i < done; i++) {
+        profile_hook(ptrs[i], size);
+    }
+    return done;
+}
 
-        *(void **)(prev_chunk + 2 * sizeof(unsigned long)) = NULL;
-        *(void **)(prev_chunk + sizeof(unsigned long)) = head;
+static int cmp_ptr(const void *a, const void *b) {
+    unsigned long x = *(unsigned long *)a, y = *(unsigned long *)b;
+    return x < y ? -1 : x > y;
+}
 
-        if (head) {
-            *(void **)(head + 2 * sizeof(unsigned long)) = prev_chunk;
+/*
+ * Free n objects; ptrs is sorted by address in place. Physically adjacent
+ * heap chunks are joined first and freed as one, so a run coalesces in a
+ * single pass, and each heap lock is taken once per run of its chunks.
+ */
+int memfree_batch(void **ptrs, unsigned long n) {
+    for (unsigned long i = 0; i < n && __atomic_load_n(&profile_live, __ATOMIC_RELAXED); i++) {
+        if (ptrs[i]) profile_free(ptrs[i]);
+    }
+    qsort(ptrs, n, sizeof(void *), cmp_ptr);
+
+    struct heap *locked = NULL;
+    unsigned long i = 0;
+    while (i < n) {
+        void *ptr = ptrs[i++];
+        if (!ptr) continue;
+
+        void *chunk = ptr - sizeof(unsigned long);
+        if (small_region_of(ptr) || (used_header(chunk) & MMAPPED)) {
+            if (locked) heap_unlock(locked);
+            locked = NULL;
+            memfree(ptr);
+            continue;
+        }
+
+        struct heap *h = heap_of(chunk);
+        if (h != locked) {
+            if (locked) heap_unlock(locked);
+            heap_lock(h);
+            locked = h;
+        }
+
+        unsigned long size = SIZE(chunk);
+        while (i < n && ptrs[i] == chunk + size + sizeof(unsigned long)) {
+            size += SIZE(ptrs[i++] - sizeof(unsigned long));
         }
-        head = prev_chunk;
+        SET_SIZE(chunk, size);
+        heap_free(h, chunk);
     }
+    if (locked) heap_unlock(locked);
+    return 0;
+}
+
+// Bytes usable at ptr; a chunk's payload runs to the end of the chunk
+unsigned long memusable(void *ptr) {
+    if (!ptr) return 0;
+
+    struct region *r = small_region_of(ptr);
+    if (r) return OBJ_SLOT(small_page_of(r, ptr)->cls);
+    return (used_header(ptr - sizeof(unsigned long)) & ~FLAGS) - sizeof(unsigned long);
+}
+
+/*
+ * Arenas carve objects out of whole regions with a bump pointer. Each region
+ * starts with a block header; the first one also holds the arena itself.
+ * Blocks stay chained after a reset and are reused in order, so reset only
+ * rewinds the bump pointer to the first block.
+ */
+struct arena_block {
+    struct arena_block *next;
+    unsigned long size;
+};
 
-    // Case 4: Both contiguous chunks are free
-    else if (prev_free && next_free) {
-        unsigned long new_size = chunk_size + prev_size + next_size;
-        *(unsigned long *)prev_chunk = new_size;
+struct memarena {
+    struct arena_block *first;
+    struct arena_block *cur;
+    void *top;
+    void *end;
+};
 
-        void *next_next_chunk = *(void **)(next_chunk + sizeof(unsigned long));
-        *(void **)(prev_chunk + sizeof(unsigned long)) = next_next_chunk;
-        if (next_next_chunk) {
-            *(void **)(next_next_chunk + 2 * sizeof(unsigned long)) = prev_chunk;
+static struct arena_block *arena_block_new(unsigned long size) {
+    unsigned long total_size = region_size(size + sizeof(struct arena_block));
+    struct arena_block *b = map_aligned(total_size);
+    if (!b) {
+        return NULL;
+    }
+    b->next = NULL;
+    b->size = total_size;
+    return b;
+}
+
+struct memarena *memarena_create(void) {
+    struct arena_block *b = arena_block_new(sizeof(struct memarena));
+    if (!b) {
+        return NULL;
+    }
+    struct memarena *a = (void *)b + sizeof(struct arena_block);
+    a->first = a->cur = b;
+    a->top = (void *)a + sizeof(struct memarena);
+    a->end = (void *)b + b->size;
+    return a;
+}
+
+void *memarena_alloc(struct memarena *a, unsigned long size) {
+    size = (size + 7) & ~7UL;
+
+    if ((unsigned long)(a->end - a->top) < size) {
+        // Move on to the next kept block if it fits, else chain in a new one
+        struct arena_block *b = a->cur->next;
+        if (!b || b->size - sizeof(struct arena_block) < size) {
+            b = arena_block_new(size);
+            if (!b) {
+                return NULL;
+            }
+            b->next = a->cur->next;
+            a->cur->next = b;
+        }
+        a->cur = b;
+        a->top = (void *)b + sizeof(struct arena_block);
+        a->end = (void *)b + b->size;
+    }
+
+    void *ptr = a->top;
+    a->top += size;
+    return ptr;
+}
+
+void memarena_reset(struct memarena *a) {
+    a->cur = a->first;
+    a->top = (void *)a + sizeof(struct memarena);
+    a->end = (void *)a->first + a->first->size;
+}
+
+void memarena_destroy(struct memarena *a) {
+    if (!a) return;
+    struct arena_block *b = a->first;
+    while (b) {
+        struct arena_block *next = b->next;
+        munmap(b, b->size);
+        b = next;
+    }
+}
+
+/*
+ * Object pools hand out fixed-size objects from slabs of one or more pages,
+ * carved in turn from whole regions. A slab is aligned to its own size, so
+ * the slab of any object is found by masking its address. The slab header
+ * keeps a bitmap with one bit per object, set while the object is free;
+ * slabs with free objects sit on the pool's partial list.
+ */
+#define SLAB_MAX_OBJS 512
+#define SLAB_MIN_OBJS 8
+
+struct slab {
+    struct mempool *pool;
+    struct slab *next;
+    unsigned int nfree;
+    unsigned long bitmap[SLAB_MAX_OBJS / 64];
+};
+
+struct mempool {
+    unsigned long obj_size;
+    unsigned long slab_size;
+    unsigned long offset;           // of the first object in a slab
+    unsigned int per_slab;
+    struct slab *partial;
+    void *carve;                    // unused part of the newest region
+    void *carve_end;
+    void **regions;
+    unsigned long nregions;
+};
+
+struct mempool *mempool_create(unsigned long obj_size, unsigned long align) {
+    if (align < sizeof(unsigned long)) align = sizeof(unsigned long);
+    if (align & (align - 1)) return NULL;
+    if (obj_size == 0) obj_size = 1;
+    obj_size = (obj_size + align - 1) & ~(align - 1);
+
+    unsigned long offset = (sizeof(struct slab) + align - 1) & ~(align - 1);
+    unsigned long slab_size = sysconf(_SC_PAGESIZE);
+    while ((slab_size - offset) / obj_size < SLAB_MIN_OBJS && slab_size < REGION_SIZE) {
+        slab_size *= 2;
+    }
+    if (slab_size - offset < obj_size) return NULL;
+
+    struct mempool *pool = memalloc(sizeof(struct mempool));
+    if (!pool) return NULL;
+    memset(pool, 0, sizeof(*pool));
+    pool->obj_size = obj_size;
+    pool->slab_size = slab_size;
+    pool->offset = offset;
+    pool->per_slab = (slab_size - offset) / obj_size;
+    if (pool->per_slab > SLAB_MAX_OBJS) pool->per_slab = SLAB_MAX_OBJS;
+    return pool;
+}
+
+static struct slab *slab_new(struct mempool *pool) {
+    if (pool->carve == pool->carve_end) {
+        void **regions = memrealloc(pool->regions, (pool->nregions + 1) * sizeof(void *));
+        if (!regions) return NULL;
+        pool->regions = regions;
+
+        void *r = map_aligned(REGION_SIZE);
+        if (!r) return NULL;
+        pool->regions[pool->nregions++] = r;
+        pool->carve = r;
+        pool->carve_end = r + REGION_SIZE;
+    }
+
+    struct slab *s = pool->carve;
+    pool->carve += pool->slab_size;
+
+    s->pool = pool;
+    s->next = NULL;
+    s->nfree = pool->per_slab;
+    memset(s->bitmap, 0, sizeof(s->bitmap));
+    for (unsigned int i = 0; i < pool->per_slab; i += 64) {
+        unsigned int n = pool->per_slab - i;
+        s->bitmap[i / 64] = n >= 64 ? ~0UL : (1UL << n) - 1;
+    }
+    return s;
+}
+
+void *mempool_get(struct mempool *pool) {
+    struct slab *s = pool->partial;
+    if (!s) {
+        s = slab_new(pool);
+        if (!s) return NULL;
+        pool->partial = s;
+    }
+
+    unsigned int w = 0;
+    while (!s->bitmap[w]) w++;
+    unsigned int i = w * 64 + __builtin_ctzl(s->bitmap[w]);
+    s->bitmap[w] &= s->bitmap[w] - 1;
+
+    if (--s->nfree == 0) {
+        pool->partial = s->next;
+        s->next = NULL;
+    }
+    return (void *)s + pool->offset + i * pool->obj_size;
+}
+
+int mempool_put(struct mempool *pool, void *ptr) {
+    if (!ptr) return -1;
+    struct slab *s = (void *)((unsigned long)ptr & ~(pool->slab_size - 1));
+    if (s->pool != pool) return -1;
+
+    unsigned int i = (ptr - (void *)s - pool->offset) / pool->obj_size;
+    s->bitmap[i / 64] |= 1UL << (i % 64);
+
+    if (s->nfree++ == 0) {
+        s->next = pool->partial;
+        pool->partial = s;
+    }
+    return 0;
+}
+
+void mempool_destroy(struct mempool *pool) {
+    if (!pool) return;
+    for (unsigned long i = 0; i < pool->nregions; i++) {
+        munmap(pool->regions[i], REGION_SIZE);
+    }
+    memfree(pool->regions);
+    memfree(pool);
+}
+
+/*
+ * Counters are kept up to date by the bins, so a snapshot costs one lock per
+ * heap plus a scan of the single largest non-empty class.
+ */
+int memstats(struct memstats *st) {
+    if (!st) return -1;
+    memset(st, 0, sizeof(*st));
+
+    for (unsigned int i = 0; i < nheaps; i++) {
+        struct heap *h = &heaps[i];
+        heap_lock(h);
+        remote_reclaim(h);
+
+        st->regions += h->nregions;
+        st->mapped += h->mapped;
+        st->free_chunks += h->nfree;
+        st->free_bytes += h->free_bytes;
+        // Usable bytes exclude each region's header and fence
+        st->in_use += h->mapped - h->nregions * (sizeof(struct region) + sizeof(unsigned long)) - h->free_bytes;
+        for (int b = 0; b < MEMSTATS_BUCKETS; b++) {
+            st->free_hist[b] += h->free_hist[b];
         }
+        st->regions += h->small_regions;
+        st->mapped += h->small_regions * REGION_SIZE;
+        st->in_use += h->small_bytes;
 
-        if (head == next_chunk) {
-            head = prev_chunk;
+        int k = -1;
+        for (int w = BINMAP_WORDS - 1; w >= 0 && k < 0; w--) {
+            if (h->binmap[w]) k = w * 64 + 63 - __builtin_clzl(h->binmap[w]);
         }
+        for (void *c = k < 0 ? NULL : h->bins[k]; c && size_class(SIZE(c)) == (unsigned int)k; c = NEXT(c)) {
+            if (SIZE(c) > st->largest_free) st->largest_free = SIZE(c);
+        }
+
+        heap_unlock(h);
     }
 
+    st->direct = __atomic_load_n(&direct_count, __ATOMIC_RELAXED);
+    st->direct_bytes = __atomic_load_n(&direct_bytes, __ATOMIC_RELAXED);
+    st->in_use += st->direct_bytes;
     return 0;
 }
 
+static int cmp_stack(const void *a, const void *b) {
+    const struct prof_sample *x = a, *y = b;
+    if (x->depth != y->depth) return x->depth - y->depth;
+    return memcmp(x->stack, y->stack, x->depth * sizeof(void *));
+}
 
+// One folded-stack frame: symbol name, else module+offset, else the address
+static void write_frame(int fd, void *pc) {
+    Dl_info info;
+    if (dladdr(pc, &info) && info.dli_sname) {
+        dprintf(fd, "%s", info.dli_sname);
+    } else if (info.dli_fname) {
+        const char *name = strrchr(info.dli_fname, '/');
+        dprintf(fd, "%s+0x%lx", name ? name + 1 : info.dli_fname, (unsigned long)(pc - info.dli_fbase));
+    } else {
+        dprintf(fd, "%p", pc);
+    }
+}
+
+/*
+ * Live samples are copied out under the lock and grouped by stack, so the
+ * symbol lookups below never run with prof_lock held.
+ */
+int memprofile_dump(int fd, int format) {
+    if (format != MEM_PROFILE_PPROF && format != MEM_PROFILE_FOLDED) return -1;
+    if (!prof_table) return -1;
+
+    bool nested = in_profiler;
+    in_profiler = true;
+
+    pthread_mutex_lock(&prof_lock);
+    unsigned long n = profile_live;
+    unsigned long len = n ? n * sizeof(struct prof_sample) : 1;
+    struct prof_sample *v = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (v == MAP_FAILED) {
+        pthread_mutex_unlock(&prof_lock);
+        in_profiler = nested;
+        return -1;
+    }
+    unsigned long i = 0;
+    for (unsigned int b = 0; b < 1U << PROF_BITS; b++) {
+        for (struct prof_sample *smp = prof_table[b]; smp; smp = smp->next) {
+            v[i++] = *smp;
+        }
+    }
+    pthread_mutex_unlock(&prof_lock);
+    qsort(v, n, sizeof(struct prof_sample), cmp_stack);
+
+    unsigned long total_objs = 0, total_bytes = 0;
+    for (i = 0; i < n; i++) {
+        total_objs += v[i].weight / v[i].size;
+        total_bytes += v[i].weight;
+    }
+    if (format == MEM_PROFILE_PPROF) {
+        dprintf(fd, "heap profile: %lu: %lu [%lu: %lu] @ heapprofile\n", total_objs, total_bytes, total_objs, total_bytes);
+    }
+
+    for (i = 0; i < n; ) {
+        unsigned long objs = 0, bytes = 0, j = i;
+        for (; j < n && cmp_stack(&v[i], &v[j]) == 0; j++) {
+            objs += v[j].weight / v[j].size;
+            bytes += v[j].weight;
+        }
+
+        if (format == MEM_PROFILE_PPROF) {
+            dprintf(fd, "%lu: %lu [%lu: %lu] @", objs, bytes, objs, bytes);
+            for (int k = 0; k < v[i].depth; k++) dprintf(fd, " %p", v[i].stack[k]);
+        } else {
+            // Folded stacks run from the root to the allocating frame
+            for (int k = v[i].depth - 1; k >= 0; k--) {
+                write_frame(fd, v[i].stack[k]);
+                if (k) dprintf(fd, ";");
+            }
+            dprintf(fd, " %lu", bytes);
+        }
+        dprintf(fd, "\n");
+        i = j;
+    }
+
+    // pprof symbolizes addresses against the process mappings
+    if (format == MEM_PROFILE_PPROF) {
+        dprintf(fd, "\nMAPPED_LIBRARIES:\n");
+        int maps = open("/proc/self/maps", O_RDONLY);
+        if (maps >= 0) {
+            char buf[4096];
+            ssize_t got;
+            while ((got = read(maps, buf, sizeof(buf))) > 0) {
+                if (write(fd, buf, got) != got) break;
+            }
+            close(maps);
+        }
+    }
+
+    munmap(v, len);
+    in_profiler = nested;
+    return 0;
+}
+
+// Hold every lock across fork() so the child never inherits one mid-update
+static void fork_prepare(void) {
+    for (unsigned int i = 0; threaded && i < nheaps; i++) {
+        pthread_mutex_lock(&heaps[i].lock);
+    }
+    pthread_mutex_lock(&regmap_lock);
+    pthread_mutex_lock(&prof_lock);
+    pthread_mutex_lock(&ready_lock);
+}
+
+static void fork_release(void) {
+    pthread_mutex_unlock(&ready_lock);
+    pthread_mutex_unlock(&prof_lock);
+    pthread_mutex_unlock(&regmap_lock);
+    for (unsigned int i = threaded ? nheaps : 0; i-- > 0; ) {
+        pthread_mutex_unlock(&heaps[i].lock);
+    }
+}
+
+// The child has no prefault thread; it keeps using what is ready
+static void fork_child(void) {
+    prefaulter = false;
+    ready_target = 0;
+    fork_release();
+}
+
+// Thread-safe mode and the prefault thread both need the handlers, once
+static void atfork_once(void) {
+    static bool registered;
+    if (!registered) pthread_atfork(fork_prepare, fork_release, fork_child);
+    registered = true;
+}
+
+static int prefault_start(unsigned long n) {
+    if (n > READY_MAX) n = READY_MAX;
+    // Nothing here may hold ready_lock: thread creation can allocate
+    if (n && !prefaulter) {
+        atfork_once();
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, prefault_main, NULL) != 0) return -1;
+        pthread_detach(tid);
+        prefaulter = true;
+    }
+    pthread_mutex_lock(&ready_lock);
+    ready_target = n;
+    pthread_cond_signal(&ready_cond);
+    pthread_mutex_unlock(&ready_lock);
+    return 0;
+}
+
+static int threads_start(unsigned long n) {
+    if (threaded) return -1;
+    if (n > MAX_HEAPS) n = MAX_HEAPS;
+    for (unsigned int i = 0; i < n; i++) {
+        pthread_mutex_init(&heaps[i].lock, NULL);
+    }
+    if (pthread_key_create(&tcache_key, tcache_release) != 0) return -1;
+    nheaps = n;
+    atfork_once();
+    threaded = true;
+    return 0;
+}
+
+int memopt(int option, unsigned long value) {
+    switch (option) {
+    case MEM_OPT_THREADS:
+        if (value == 0) value = sysconf(_SC_NPROCESSORS_ONLN);
+        return threads_start(value);
+
+    case MEM_OPT_PERCPU:
+        if (value == 0) return -1;
+        // CPU numbers run up to the configured count, not the online one
+        if (threads_start(sysconf(_SC_NPROCESSORS_CONF)) != 0) return -1;
+        percpu = true;
+        return 0;
+
+    case MEM_OPT_RETAIN:
+        retain_bytes = value;
+        return 0;
+
+    case MEM_OPT_MMAP_THRESHOLD:
+        mmap_threshold = value;
+        return 0;
+
+    case MEM_OPT_SMALL_PAGES:
+        small_pages = value != 0;
+        return 0;
+
+    case MEM_OPT_PROFILE:
+        return profile_start(value);
+
+    case MEM_OPT_POPULATE:
+        populate = value != 0;
+        return 0;
+
+    case MEM_OPT_PREFAULT:
+        return prefault_start(value);
+
+    case MEM_OPT_HUGEPAGES:
+        if (value > MEM_HUGE_TLB) return -1;
+        huge_pages = value;
+        return 0;
+    }
+    return -1;
+}
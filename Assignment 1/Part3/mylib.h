@@ -4,4 +4,127 @@
 void *memalloc(unsigned long size);
 int memfree(void *ptr);
 
+// Grows in place when it can; memrealloc(NULL, n) allocates, (ptr, 0) frees
+void *memrealloc(void *ptr, unsigned long size);
+void *memcalloc(unsigned long nmemb, unsigned long size);
+// alignment must be a power of two
+void *memalign(unsigned long alignment, unsigned long size);
+// Bytes usable at ptr, at least the size it was allocated with
+unsigned long memusable(void *ptr);
+
+/*
+ * Batch calls. memalloc_batch() stores up to n objects of size bytes in ptrs
+ * and returns how many it allocated. memfree_batch() frees n objects, skips
+ * NULL entries and sorts ptrs by address as a side effect.
+ */
+unsigned long memalloc_batch(unsigned long size, unsigned long n, void **ptrs);
+int memfree_batch(void **ptrs, unsigned long n);
+
+/*
+ * Arenas: bump-pointer allocation without per-object headers for objects
+ * that die together. There is no per-object free; memarena_reset() drops
+ * every object in O(1) and keeps the memory for reuse. An arena must not be
+ * used from several threads at once.
+ */
+struct memarena;
+
+struct memarena *memarena_create(void);
+void *memarena_alloc(struct memarena *a, unsigned long size);
+void memarena_reset(struct memarena *a);
+void memarena_destroy(struct memarena *a);
+
+/*
+ * Object pools: constant-time allocation of obj_size objects aligned to
+ * align (a power of two; 0 means 8), packed densely into page-sized slabs.
+ * mempool_put() returns 0, or -1 if ptr does not belong to the pool.
+ * A pool must not be used from several threads at once.
+ */
+struct mempool;
+
+struct mempool *mempool_create(unsigned long obj_size, unsigned long align);
+void *mempool_get(struct mempool *pool);
+int mempool_put(struct mempool *pool, void *ptr);
+void mempool_destroy(struct mempool *pool);
+
+/*
+ * Heap snapshot filled in by memstats(). Sizes are in bytes and include
+ * chunk headers. Chunks held in per-thread caches count as in use.
+ * free_hist[i] counts free chunks of size [2^i, 2^(i+1)).
+ */
+#define MEMSTATS_BUCKETS 64
+
+struct memstats {
+    unsigned long regions;          // heap regions mapped
+    unsigned long mapped;           // bytes in heap regions
+    unsigned long direct;           // chunks with a mapping of their own
+    unsigned long direct_bytes;
+    unsigned long in_use;           // allocated bytes, heap and direct
+    unsigned long free_chunks;
+    unsigned long free_bytes;
+    unsigned long largest_free;     // biggest free heap chunk
+    unsigned long free_hist[MEMSTATS_BUCKETS];
+};
+
+int memstats(struct memstats *st);
+
+/*
+ * Allocator options for memopt(); it returns 0 on success and -1 otherwise.
+ *
+ * MEM_OPT_THREADS: switch to thread-safe mode with value heaps (0 = one per
+ *                  CPU). Call once, before any other thread uses the library.
+ * MEM_OPT_RETAIN:  bytes of entirely free regions each heap keeps resident
+ *                  (default 4 MB). Free regions beyond that are unmapped; the
+ *                  last region of a heap is kept but its pages are released.
+ * MEM_OPT_MMAP_THRESHOLD: allocations above this many bytes (default 256 KB)
+ *                  get a mapping of their own, unmapped again by memfree.
+ * MEM_OPT_SMALL_PAGES: when value is non-zero, requests up to 256 bytes are
+ *                  served without a chunk header from pages holding a single
+ *                  object size. Objects are 8-byte aligned as before.
+ * MEM_OPT_HUGEPAGES: back regions mapped from now on with 2 MB pages.
+ *                  MEM_HUGE_THP asks for transparent huge pages;
+ *                  MEM_HUGE_TLB maps them from the hugetlb pool
+ *                  (vm.nr_hugepages) and falls back to THP when it is empty.
+ *                  Large allocations with a mapping of their own are not
+ *                  affected.
+ * MEM_OPT_PROFILE: sample about one allocation per value bytes allocated
+ *                  and record its call stack while it is live (0 = stop
+ *                  sampling). See memprofile_dump().
+ * MEM_OPT_PERCPU:  thread-safe mode with one heap per CPU and no per-thread
+ *                  caches, for programs with many mostly idle threads
+ *                  (value must be non-zero). Use instead of MEM_OPT_THREADS,
+ *                  under the same rules.
+ * MEM_OPT_POPULATE: when value is non-zero, fault in every page of a region
+ *                  as it is mapped, so first use takes no page faults.
+ * MEM_OPT_PREFAULT: keep value populated regions (at most 64) ready to be
+ *                  handed to a growing heap, refilled by a background thread
+ *                  started on first use (0 = stop refilling).
+ */
+#define MEM_OPT_THREADS 1
+#define MEM_OPT_RETAIN 2
+#define MEM_OPT_MMAP_THRESHOLD 3
+#define MEM_OPT_SMALL_PAGES 4
+#define MEM_OPT_HUGEPAGES 5
+#define MEM_OPT_PROFILE 6
+#define MEM_OPT_PERCPU 7
+#define MEM_OPT_POPULATE 8
+#define MEM_OPT_PREFAULT 9
+
+#define MEM_HUGE_OFF 0
+#define MEM_HUGE_THP 1
+#define MEM_HUGE_TLB 2
+
+int memopt(int option, unsigned long value);
+
+/*
+ * Write the live samples of the heap profiler to fd, one line per call
+ * stack with the bytes it is estimated to hold. MEM_PROFILE_PPROF is the
+ * legacy heap profile text read by pprof; MEM_PROFILE_FOLDED is one
+ * "root;...;caller bytes" line per stack, as taken by flame graph tools.
+ * Returns -1 if profiling was never enabled.
+ */
+#define MEM_PROFILE_PPROF 0
+#define MEM_PROFILE_FOLDED 1
+
+int memprofile_dump(int fd, int format);
+
 #endif 
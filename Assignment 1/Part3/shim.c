@@ -0,0 +1,224 @@
+/*
+ * malloc-compatible entry points on top of memalloc, built into
+ * libmylib.so for use with LD_PRELOAD:
+ *
+ *     LD_PRELOAD=./libmylib.so ./program
+ *
+ * The first call switches the library to thread-safe mode. Anything
+ * allocated while that is under way (setup code calling back into malloc)
+ * is served from a small static bootstrap area that is never freed.
+ *
+ * With MEMALLOC_TRACE=file in the environment every call is also logged to
+ * file in the format of Tools/trace.h, for Tools/replay. Traced calls are
+ * serialized so the log order is the order the heap saw them in.
+ */
+#include <errno.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mylib.h"
+#include "Tools/trace.h"
+
+#define BOOTSTRAP_SIZE (64 * 1024)
+
+static char bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(16)));
+static unsigned long bootstrap_used;
+
+static int initialized;
+static __thread int initializing;
+
+#define TRACE_BUF 4096
+
+static int trace_fd = -1;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_rec trace_buf[TRACE_BUF];
+static unsigned int trace_len;
+static __thread bool in_trace;      // a traced call reached malloc again
+
+// Bump allocation; each block is preceded by its size
+static void *bootstrap_alloc(size_t size) {
+    size = (size + 15) & ~15UL;
+    unsigned long off = __atomic_fetch_add(&bootstrap_used, size + 16, __ATOMIC_RELAXED);
+    if (off + size + 16 > BOOTSTRAP_SIZE) return NULL;
+    *(unsigned long *)(bootstrap + off) = size;
+    return bootstrap + off + 16;
+}
+
+static int is_bootstrap(void *ptr) {
+    return (char *)ptr >= bootstrap && (char *)ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+static void trace_flush(void) {
+    if (trace_len && write(trace_fd, trace_buf, trace_len * sizeof(struct trace_rec)) < 0) {
+        trace_fd = -1;
+    }
+    trace_len = 0;
+}
+
+static void trace_fork_prepare(void) {
+    pthread_mutex_lock(&trace_lock);
+}
+
+static void trace_fork_parent(void) {
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// The child's calls are not part of the parent's trace
+static void trace_fork_child(void) {
+    trace_fd = -1;
+    trace_len = 0;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_open(void) {
+    const char *path = getenv("MEMALLOC_TRACE");
+    if (!path) return;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    if (write(fd, TRACE_MAGIC, 8) != 8) {
+        close(fd);
+        return;
+    }
+    pthread_atfork(trace_fork_prepare, trace_fork_parent, trace_fork_child);
+    trace_fd = fd;
+}
+
+__attribute__((destructor)) static void trace_close(void) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0) {
+        trace_flush();
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Returns true, holding trace_lock, if the call about to be made is traced
+static bool trace_begin(void) {
+    if (trace_fd < 0 || in_trace) return false;
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd < 0) {
+        pthread_mutex_unlock(&trace_lock);
+        return false;
+    }
+    in_trace = true;
+    return true;
+}
+
+static void trace_put(uint64_t op, uint64_t size, void *id) {
+    trace_buf[trace_len++] = (struct trace_rec){ op, size, (uint64_t)id };
+    if (trace_len == TRACE_BUF) trace_flush();
+}
+
+// Log the call unless it failed (id is NULL) and drop trace_lock
+static void trace_end(uint64_t op, uint64_t size, void *id) {
+    if (id) trace_put(op, size, id);
+    in_trace = false;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Returns 0 once memalloc can be used from this thread
+static int ensure_init(void) {
+    if (__atomic_load_n(&initialized, __ATOMIC_ACQUIRE)) return 0;
+    if (initializing) return -1;
+
+    initializing = 1;
+    static int started;
+    if (!__atomic_exchange_n(&started, 1, __ATOMIC_ACQ_REL)) {
+        memopt(MEM_OPT_THREADS, 0);
+        trace_open();
+        __atomic_store_n(&initialized, 1, __ATOMIC_RELEASE);
+    }
+    while (!__atomic_load_n(&initialized, __ATOMIC_ACQUIRE))
+        ;
+    initializing = 0;
+    return 0;
+}
+
+static void *checked(void *ptr) {
+    if (!ptr) errno = ENOMEM;
+    return ptr;
+}
+
+void *malloc(size_t size) {
+    if (ensure_init() != 0) return checked(bootstrap_alloc(size));
+    bool traced = trace_begin();
+    void *ptr = memalloc(size);
+    if (traced) trace_end(TRACE_MALLOC, size, ptr);
+    return checked(ptr);
+}
+
+void free(void *ptr) {
+    if (!ptr || is_bootstrap(ptr)) return;
+    bool traced = trace_begin();
+    memfree(ptr);
+    if (traced) trace_end(TRACE_FREE, 0, ptr);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    if (ensure_init() != 0) {
+        size_t total;
+        if (__builtin_mul_overflow(nmemb, size, &total)) return checked(NULL);
+        return checked(bootstrap_alloc(total));     // static storage is zero
+    }
+    bool traced = trace_begin();
+    void *ptr = memcalloc(nmemb, size);
+    if (traced) trace_end(TRACE_CALLOC, nmemb * size, ptr);
+    return checked(ptr);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (ptr && is_bootstrap(ptr)) {
+        unsigned long old_size = *(unsigned long *)((char *)ptr - 16);
+        void *new_ptr = malloc(size);
+        if (new_ptr) memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+        return new_ptr;
+    }
+    if (ensure_init() != 0) return checked(bootstrap_alloc(size));
+    bool traced = trace_begin();
+    void *new_ptr = memrealloc(ptr, size);
+    if (traced) {
+        if (!ptr) {
+            trace_end(TRACE_MALLOC, size, new_ptr);
+        } else if (!size) {
+            trace_end(TRACE_FREE, 0, ptr);
+        } else {
+            if (new_ptr) trace_put(TRACE_REALLOC, size, ptr);
+            trace_end(TRACE_MOVE, 0, new_ptr);
+        }
+    }
+    return size ? checked(new_ptr) : new_ptr;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void *) || (alignment & (alignment - 1))) return EINVAL;
+    if (ensure_init() != 0) return ENOMEM;
+
+    bool traced = trace_begin();
+    void *ptr = memalign(alignment, size);
+    if (traced) trace_end(TRACE_MEMALIGN_OP(alignment), size, ptr);
+    if (!ptr) return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (ensure_init() != 0) return checked(NULL);
+    bool traced = trace_begin();
+    void *ptr = memalign(alignment, size);
+    if (traced) trace_end(TRACE_MEMALIGN_OP(alignment ? alignment : 1), size, ptr);
+    return checked(ptr);
+}
+
+void *valloc(size_t size) {
+    return aligned_alloc(4096, size);
+}
+
+size_t malloc_usable_size(void *ptr) {
+    if (ptr && is_bootstrap(ptr)) return *(unsigned long *)((char *)ptr - 16);
+    return memusable(ptr);
+}